@@ -0,0 +1,7 @@
+#pragma once
+
+// On-target microbenchmarks, built with -DPICO_BENCHMARKS=ON and run once at startup.
+// Results are logged in SysTick cycles of the system clock.
+#ifdef PICO_BENCHMARKS
+void run_benchmarks();
+#endif
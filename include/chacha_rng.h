@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <span>
+
+// Reseed from hardware entropy after this many 64 byte blocks
+#ifndef CHACHA_RNG_RESEED_BLOCKS
+#define CHACHA_RNG_RESEED_BLOCKS 65536
+#endif
+
+// ChaCha20 keystream used as a CSPRNG. It is seeded from mbedtls_hardware_poll (ring
+// oscillator based and slow) only once per CHACHA_RNG_RESEED_BLOCKS, each block gives 16 words.
+class chacha_rng {
+public:
+    static chacha_rng &instance();
+
+    uint32_t next();
+    void fill(std::span<uint8_t> out);
+    void reseed();
+    // Starts the keystream at the given key, block counter and nonce (RFC 8439 2.3). reseed()
+    // takes both from hardware entropy, this is for known-answer tests.
+    void seed(std::span<const uint8_t, 32> key, uint32_t counter, std::span<const uint8_t, 12> nonce);
+
+private:
+    uint32_t state[16];
+    uint32_t block[16];
+    size_t index = 16;
+    uint32_t blocks = 0;
+    bool seeded = false;
+
+    chacha_rng() = default;
+
+    void generate();
+};
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <array>
 #include <memory>
 #include <optional>
 #include <span>
@@ -53,6 +54,8 @@ public:
 	size_t size() const;
 
 	void advance(size_t amount);
+	// The first count stored items without removing them, the second span is non-empty when they wrap around
+	std::array<std::span<const T>, 2> peek(size_t count) const;
 
 	iterator begin() const;
 	iterator end() const;
@@ -1,7 +1,31 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
+#include <initializer_list>
+#include <pico/async_context.h>
 #include "websocket.h"
+#include "eio_handshake.h"
+#include "eio_transport.h"
+
+// tcp poll interval once the session is open. Ping timeouts don't depend on it, but it
+// refreshes the watchdog, which bites after 8 s.
+#ifndef EIO_POLL_INTERVAL_S
+#define EIO_POLL_INTERVAL_S 4
+#endif
+
+// How late pings arrive, bucket 0 counts delays under 2 ms, bucket i those in [2^i, 2^(i+1))
+// ms and the last one everything above
+struct eio_delay_histogram {
+    static constexpr size_t bucket_count = 16;
+
+    std::array<uint32_t, bucket_count> buckets{};
+    uint32_t count = 0;
+    int64_t max_ms = 0;
+
+    void add(int64_t ms);
+    void log() const;
+};
 
 class eio_client {
 public:
@@ -15,34 +39,71 @@ public:
         noop
     };
 
+    // Takes ownership of the transport
+    eio_client(eio_transport *transport);
     eio_client(ws::websocket *socket);
-    eio_client(tcp_base *socket);
-    ~eio_client() { 
-        trace1("~eio_client\n");
-        delete socket_;
-    }
+    eio_client(tcp_base *socket, ws::deflate_options deflate = {});
+    ~eio_client();
+
+    // Largest number of pieces send_message accepts
+    static constexpr size_t max_message_pieces = 7;
+    // Log the ping delay histogram every this many pings, 0 to never log it
+    static constexpr uint32_t delay_log_interval = 32;
 
     size_t read(std::span<uint8_t> data);
-    // Needs 1 + 14 add'l bytes to encode message
-    bool send_message(std::span<uint8_t> data);
+    bool send_message(std::span<const uint8_t> data);
+    // Sends the pieces as one message without concatenating them
+    bool send_message(std::span<const std::span<const uint8_t>> pieces);
+    bool send_message(std::initializer_list<std::span<const uint8_t>> pieces);
     uint32_t packet_size() const;
+    // Only valid once on_open has been called
+    const eio_handshake &handshake() const;
+    const char *transport_name() const;
+
+    // Time between consecutive pings (the first one counts from the handshake) beyond
+    // pingInterval. Server load and network jitter show up here; a delay approaching
+    // pingTimeout means the session is close to being dropped.
+    const eio_delay_histogram &ping_delay() const;
+    // Sends a close packet and closes the transport
+    void close();
 
     void on_open(std::function<void()> callback);
     void on_receive(std::function<void()> callback);
+    // Binary messages have no packet type on websocket. The spans are only valid during the call.
+    void on_binary(std::function<void(std::span<const uint8_t> first, std::span<const uint8_t> second)> callback);
     void on_closed(std::function<void(err_t)> callback);
 
+    // Starts the transport, call once the callbacks are set
     void read_initial_packet();
     void set_refresh_watchdog();
 
 private:
-    ws::websocket *socket_;
+    eio_transport *transport_;
+    // Transport we upgraded away from, deleted on the next poll since it was still on the stack
+    eio_transport *retired = nullptr;
     std::function<void()> user_receive_callback, user_open_callback;
+    std::function<void(std::span<const uint8_t>, std::span<const uint8_t>)> user_binary_callback;
     std::function<void(err_t)> user_close_callback;
-    std::string sid;
-    int ping_interval, ping_timeout, ping_milliseconds;
+    eio_handshake handshake_;
+    eio_delay_histogram ping_delay_;
+    absolute_time_t last_ping = nil_time;
+    // Fires pingInterval + pingTimeout after the last ping from the server
+    async_at_time_worker_t ping_deadline;
     bool open_, refresh_watchdog_;
 
-    void ws_recv_callback();
-    void ws_poll_callback();
-    void ws_close_callback(err_t reason);
+    void arm_ping_deadline();
+    void disarm_ping_deadline();
+    static void ping_deadline_expired(async_context_t *context, async_at_time_worker_t *worker);
+
+    // Control packets are sent from static storage
+    static constexpr uint8_t pong_packet = (uint8_t)packet_type::pong;
+    static constexpr uint8_t close_packet = (uint8_t)packet_type::close;
+
+    void bind_transport();
+    void upgrade_callback(eio_transport *next);
+
+    void transport_recv_callback();
+    void transport_binary_callback(std::span<const uint8_t> first, std::span<const uint8_t> second);
+    void transport_poll_callback();
+    void transport_close_callback(err_t reason);
 };
\ No newline at end of file
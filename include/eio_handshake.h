@@ -0,0 +1,221 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+// Engine.IO session ids are 20 characters of base64id, leave room for custom id generators
+#ifndef EIO_SID_MAX_LENGTH
+#define EIO_SID_MAX_LENGTH 32
+#endif
+
+// Longest open packet eio_client reads, servers send about 120 bytes
+#ifndef EIO_HANDSHAKE_MAX_SIZE
+#define EIO_HANDSHAKE_MAX_SIZE 256
+#endif
+
+// The fields of the Engine.IO open packet body
+//
+//     {"sid":"lv_VI97HAXpY6yYWAAAC","upgrades":["websocket"],"pingInterval":25000,"pingTimeout":20000,"maxPayload":1000000}
+//
+// that the client uses, extracted without building a JSON DOM or allocating. Other keys are skipped.
+struct eio_handshake {
+    enum class status_code : uint8_t {
+        ok,
+        malformed,
+        missing_field,
+        sid_too_long,
+        number_too_large
+    };
+
+    status_code status = status_code::malformed;
+    std::array<char, EIO_SID_MAX_LENGTH> sid_buffer{};
+    uint8_t sid_length = 0;
+    uint32_t ping_interval = 0, ping_timeout = 0;
+    // 0 if the server didn't send one (Engine.IO v3)
+    uint32_t max_payload = 0;
+    // "websocket" is listed in upgrades
+    bool websocket_upgrade = false;
+
+    constexpr bool valid() const {
+        return status == status_code::ok;
+    }
+
+    constexpr std::string_view sid() const {
+        return {sid_buffer.data(), sid_length};
+    }
+
+    static constexpr eio_handshake parse(std::string_view json) {
+        eio_handshake result;
+        cursor in{json};
+        bool has_sid = false, has_interval = false, has_timeout = false;
+
+        if(!in.consume('{')) {
+            return result;
+        }
+        if(!in.consume('}')) {
+            do {
+                std::string_view key;
+                if(!in.string(key) || !in.consume(':')) {
+                    return result;
+                }
+                if(key == "sid") {
+                    std::string_view sid;
+                    if(!in.string(sid) || sid.find('\\') != std::string_view::npos) {
+                        return result;
+                    }
+                    if(sid.size() > EIO_SID_MAX_LENGTH) {
+                        return result.fail(status_code::sid_too_long);
+                    }
+                    sid.copy(result.sid_buffer.data(), sid.size());
+                    result.sid_length = sid.size();
+                    has_sid = true;
+                } else if(key == "pingInterval" || key == "pingTimeout" || key == "maxPayload") {
+                    uint64_t value = 0;
+                    if(!in.number(value)) {
+                        return result;
+                    }
+                    if(value > UINT32_MAX) {
+                        return result.fail(status_code::number_too_large);
+                    }
+                    if(key == "pingInterval") {
+                        result.ping_interval = value;
+                        has_interval = true;
+                    } else if(key == "pingTimeout") {
+                        result.ping_timeout = value;
+                        has_timeout = true;
+                    } else {
+                        result.max_payload = value;
+                    }
+                } else if(key == "upgrades") {
+                    if(!in.consume('[')) {
+                        return result;
+                    }
+                    if(!in.consume(']')) {
+                        do {
+                            std::string_view upgrade;
+                            if(!in.string(upgrade)) {
+                                return result;
+                            }
+                            result.websocket_upgrade = result.websocket_upgrade || upgrade == "websocket";
+                        } while(in.consume(','));
+                        if(!in.consume(']')) {
+                            return result;
+                        }
+                    }
+                } else if(!in.skip_value()) {
+                    return result;
+                }
+            } while(in.consume(','));
+            if(!in.consume('}')) {
+                return result;
+            }
+        }
+        in.skip_whitespace();
+        if(in.position != json.size()) {
+            return result;
+        }
+        if(!has_sid || !has_interval || !has_timeout) {
+            return result.fail(status_code::missing_field);
+        }
+
+        result.status = status_code::ok;
+        return result;
+    }
+
+private:
+    struct cursor {
+        std::string_view text;
+        size_t position = 0;
+
+        constexpr void skip_whitespace() {
+            while(position < text.size() && (text[position] == ' ' || text[position] == '\t' || text[position] == '\n' || text[position] == '\r')) {
+                position++;
+            }
+        }
+
+        constexpr bool consume(char c) {
+            skip_whitespace();
+            if(position < text.size() && text[position] == c) {
+                position++;
+                return true;
+            }
+            return false;
+        }
+
+        // The raw contents between the quotes, escapes are left as they are
+        constexpr bool string(std::string_view &out) {
+            if(!consume('"')) {
+                return false;
+            }
+            size_t start = position;
+            while(position < text.size() && text[position] != '"') {
+                position += text[position] == '\\' ? 2 : 1;
+            }
+            if(position >= text.size()) {
+                return false;
+            }
+            out = text.substr(start, position - start);
+            position++;
+            return true;
+        }
+
+        // Non-negative integers only, which is all Engine.IO sends
+        constexpr bool number(uint64_t &out) {
+            skip_whitespace();
+            size_t start = position;
+            out = 0;
+            while(position < text.size() && text[position] >= '0' && text[position] <= '9') {
+                if(out <= UINT32_MAX) {
+                    out = out * 10 + (text[position] - '0');
+                }
+                position++;
+            }
+            return position > start;
+        }
+
+        constexpr bool skip_value() {
+            skip_whitespace();
+            if(position >= text.size()) {
+                return false;
+            }
+            if(text[position] == '"') {
+                std::string_view ignored;
+                return string(ignored);
+            }
+            if(text[position] == '{' || text[position] == '[') {
+                int depth = 0;
+                while(position < text.size()) {
+                    char c = text[position];
+                    if(c == '"') {
+                        std::string_view ignored;
+                        if(!string(ignored)) {
+                            return false;
+                        }
+                        continue;
+                    }
+                    position++;
+                    if(c == '{' || c == '[') {
+                        depth++;
+                    } else if((c == '}' || c == ']') && --depth == 0) {
+                        return true;
+                    }
+                }
+                return false;
+            }
+            // Numbers, true, false and null
+            size_t start = position;
+            while(position < text.size() && text[position] != ',' && text[position] != '}' && text[position] != ']'
+                && text[position] != ' ' && text[position] != '\t' && text[position] != '\n' && text[position] != '\r') {
+                position++;
+            }
+            return position > start;
+        }
+    };
+
+    constexpr eio_handshake fail(status_code code) const {
+        eio_handshake result = *this;
+        result.status = code;
+        return result;
+    }
+};
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+#include <pico/async_context.h>
+
+#include "eio_transport.h"
+#include "http_client.h"
+#include "url_view.h"
+
+// Separates the packets of an Engine.IO v4 polling payload
+#define EIO_RECORD_SEPARATOR '\x1e'
+
+// Engine.IO v4 HTTP long-polling. One GET is kept outstanding for packets from the server,
+// packets written while a POST is in flight are batched into the next one. Both requests
+// keep their connection alive through the tcp_pool.
+//
+// When the handshake offers websocket, a second connection is upgraded and probed
+// ("2probe"/"3probe"). Once polling is drained the upgrade packet goes out on it and
+// on_upgrade hands over an eio_websocket_transport.
+class eio_polling_transport : public eio_transport {
+public:
+    // target is the path and query without transport and sid, e.g. "/socket.io/?EIO=4".
+    // The url must outlive the transport.
+    eio_polling_transport(url_view url, std::string target);
+    ~eio_polling_transport();
+
+    const char *name() const override;
+    uint32_t packet_size() const override;
+    size_t read(std::span<uint8_t> data) override;
+    bool write(std::span<const std::span<const uint8_t>> pieces, ws::priority level) override;
+    void close(err_t reason) override;
+    bool connected() override;
+    void start() override;
+    void opened(const eio_handshake &handshake) override;
+
+    void on_receive(std::function<void()> callback) override;
+    void on_poll(uint8_t interval_seconds, std::function<void()> callback) override;
+    void on_closed(std::function<void(err_t)> callback) override;
+    void on_upgrade(std::function<void(eio_transport*)> callback) override;
+
+    // Stay on polling even if the server offers websocket
+    void disable_upgrade();
+
+private:
+    url_view url_;
+    std::string target_, sid_;
+    http_client *poll_http = nullptr, *send_http = nullptr, *probe_http = nullptr;
+    ws::websocket *probe = nullptr;
+    std::function<void()> user_receive_callback, user_poll_callback;
+    std::function<void(err_t)> user_close_callback;
+    std::function<void(eio_transport*)> user_upgrade_callback;
+
+    // Body of the last GET and the packet in it that is being delivered
+    std::string payload;
+    size_t packet_start = 0, packet_end = 0, read_position = 0;
+    // Packets waiting for the next POST, separated by EIO_RECORD_SEPARATOR
+    std::string outbound;
+
+    async_at_time_worker_t poll_timer;
+    uint32_t poll_interval_ms = 0;
+    bool open_ = false, closed_ = false, polling = false, sending = false;
+    bool upgrade_enabled = true, paused = false;
+    // Set by the destructor so a callback can tell it deleted us
+    bool *destroyed = nullptr;
+
+    std::string request_target(std::string_view transport) const;
+    void poll();
+    void flush();
+    bool deliver();
+    void upgrade_if_drained();
+
+    void poll_response_callback();
+    void send_response_callback();
+    void probe_response_callback();
+    void probe_receive_callback();
+    static void poll_timer_callback(async_context_t *context, async_at_time_worker_t *worker);
+};
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <span>
+
+#include "lwip/err.h"
+
+#include "websocket.h"
+#include "eio_handshake.h"
+
+// Carries Engine.IO packets for eio_client. A packet starts with its type byte on every
+// transport; how packets are framed on the wire is up to the transport.
+class eio_transport {
+public:
+    virtual ~eio_transport() = default;
+
+    virtual const char *name() const = 0;
+
+    // Only valid inside the on_receive callback: size of the packet being delivered
+    // including its type byte, and reads from it. Whatever is left unread is skipped.
+    virtual uint32_t packet_size() const = 0;
+    virtual size_t read(std::span<uint8_t> data) = 0;
+
+    // Sends the pieces, type byte first, as one packet
+    virtual bool write(std::span<const std::span<const uint8_t>> pieces, ws::priority level = ws::priority::normal) = 0;
+    virtual void close(err_t reason) = 0;
+    virtual bool connected() = 0;
+
+    // Starts delivering packets once the callbacks are set
+    virtual void start() = 0;
+    // Called by eio_client once the open packet was parsed
+    virtual void opened(const eio_handshake &handshake) {}
+
+    virtual void on_receive(std::function<void()> callback) = 0;
+    // Binary messages, in place where the transport can. Transports that can't carry them ignore this.
+    virtual void on_binary(std::function<void(std::span<const uint8_t> first, std::span<const uint8_t> second)> callback) {}
+    virtual void on_poll(uint8_t interval_seconds, std::function<void()> callback) = 0;
+    virtual void on_closed(std::function<void(err_t)> callback) = 0;
+    // Called with the transport to continue on once an upgrade finished. The old transport
+    // must not be deleted from inside the callback.
+    virtual void on_upgrade(std::function<void(eio_transport*)> callback) {}
+};
+
+// One packet per websocket text frame, binary frames are whole binary messages
+class eio_websocket_transport : public eio_transport {
+public:
+    eio_websocket_transport(ws::websocket *socket);
+    ~eio_websocket_transport();
+
+    const char *name() const override;
+    uint32_t packet_size() const override;
+    size_t read(std::span<uint8_t> data) override;
+    bool write(std::span<const std::span<const uint8_t>> pieces, ws::priority level) override;
+    void close(err_t reason) override;
+    bool connected() override;
+    void start() override;
+
+    void on_receive(std::function<void()> callback) override;
+    void on_binary(std::function<void(std::span<const uint8_t> first, std::span<const uint8_t> second)> callback) override;
+    void on_poll(uint8_t interval_seconds, std::function<void()> callback) override;
+    void on_closed(std::function<void(err_t)> callback) override;
+
+private:
+    ws::websocket *socket_;
+};
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+
+// 32 bit FNV-1a
+constexpr uint32_t fnv1a(std::string_view text) {
+    uint32_t hash = 2166136261u;
+    for(char c : text) {
+        hash = (hash ^ (uint8_t)c) * 16777619u;
+    }
+    return hash;
+}
+
+// Values keyed by event name with precomputed hashes. Once frozen the entries are sorted
+// by hash, so a lookup hashes the name once, binary searches and only compares strings to
+// confirm. Adding an event unfreezes the table.
+//
+// Entries live in a deque so adding one doesn't move the others: a handler that registers
+// another handler while it is being called keeps its own entry. Only freeze and erase move
+// entries.
+template <typename V>
+class event_table {
+public:
+    // Inserts a default value if the name is new
+    V &operator[](std::string_view name) {
+        V *found = find(name);
+        if(found) {
+            return *found;
+        }
+        frozen_ = false;
+        entries.push_back({fnv1a(name), std::string(name), V{}});
+        return entries.back().value;
+    }
+
+    V *find(std::string_view name) {
+        auto iter = find_entry(name);
+        return iter != entries.end() ? &iter->value : nullptr;
+    }
+
+    bool erase(std::string_view name) {
+        auto iter = find_entry(name);
+        if(iter == entries.end()) {
+            return false;
+        }
+        // Removing keeps the order, so a frozen table stays sorted
+        entries.erase(iter);
+        return true;
+    }
+
+    void freeze() {
+        if(frozen_) {
+            return;
+        }
+        std::sort(entries.begin(), entries.end(), [](const entry &a, const entry &b) { return a.hash < b.hash; });
+        entries.shrink_to_fit();
+        frozen_ = true;
+    }
+
+    bool frozen() const {
+        return frozen_;
+    }
+
+    size_t size() const {
+        return entries.size();
+    }
+
+private:
+    struct entry {
+        uint32_t hash;
+        std::string name;
+        V value;
+    };
+
+    std::deque<entry> entries;
+    bool frozen_ = false;
+
+    typename std::deque<entry>::iterator find_entry(std::string_view name) {
+        uint32_t hash = fnv1a(name);
+        auto iter = frozen_
+            ? std::lower_bound(entries.begin(), entries.end(), hash, [](const entry &e, uint32_t h) { return e.hash < h; })
+            : entries.begin();
+        for(; iter != entries.end(); iter++) {
+            if(iter->hash == hash && iter->name == name) {
+                return iter;
+            }
+            if(frozen_ && iter->hash != hash) {
+                break;
+            }
+        }
+        return entries.end();
+    }
+};
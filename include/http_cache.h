@@ -0,0 +1,83 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <string_view>
+#include <cstdint>
+
+#ifdef HTTP_CACHE_FLASH_OFFSET
+#include <pico/time.h>
+#endif
+
+#ifndef HTTP_CACHE_ENTRIES
+#define HTTP_CACHE_ENTRIES 4
+#endif
+
+// Larger bodies are not cached
+#ifndef HTTP_CACHE_MAX_BODY
+#define HTTP_CACHE_MAX_BODY 4096
+#endif
+
+// Define HTTP_CACHE_FLASH_OFFSET to the start of HTTP_CACHE_ENTRIES free flash sectors to keep cached bodies
+// in flash instead of RAM. HTTP_CACHE_MAX_BODY must then fit in a sector.
+//
+// Wear budget: each write erases the entry's whole 4 KiB sector, and the flash is rated for about 100k
+// erase cycles per sector. Bodies that come back unchanged are never rewritten, and changed ones stay
+// in RAM until persist() writes them at most once per HTTP_CACHE_FLASH_INTERVAL_MS. So a sector is
+// erased at most once per interval: with the default 10 minutes, a body that changes on every request
+// wears its sector out after 100000 * 10 min, about 1.9 years. Raise the interval for frequent changes.
+
+// Minimum time between flash writes
+#ifndef HTTP_CACHE_FLASH_INTERVAL_MS
+#define HTTP_CACHE_FLASH_INTERVAL_MS (10 * 60 * 1000)
+#endif
+
+// How often the thread loop calls persist() when the cache uses flash
+#ifndef HTTP_CACHE_PERSIST_POLL_MS
+#define HTTP_CACHE_PERSIST_POLL_MS 1000
+#endif
+
+// Remembers ETag/Last-Modified and the body of GET responses by URL so unchanged
+// resources can be revalidated with a conditional request and served from the cache on a 304.
+class http_cache {
+public:
+    struct entry {
+        std::string url, etag, last_modified;
+        uint32_t size = 0;
+        uint32_t last_used = 0;
+        bool in_flash = false;
+        // Changed body waiting in RAM for persist()
+        bool dirty = false;
+        std::string body;
+    };
+
+    static http_cache &instance();
+
+    const entry *find(const std::string &url);
+    void store(const std::string &url, const std::string &etag, const std::string &last_modified, std::string_view body);
+    bool load(const std::string &url, std::string &body);
+    void erase(const std::string &url);
+    // Writes changed bodies to flash once HTTP_CACHE_FLASH_INTERVAL_MS has passed since the
+    // last write. Flash writes lock out the other core and stall this one, so this must be
+    // called from thread context, never from an interrupt or an async_context worker (which
+    // under cyw43_arch_lwip_threadsafe_background run from one). Does nothing without flash.
+    void persist();
+
+    uint32_t hits() const { return hits_; }
+    uint32_t misses() const { return misses_; }
+
+private:
+    std::array<entry, HTTP_CACHE_ENTRIES> entries;
+    uint32_t use_counter = 0, hits_ = 0, misses_ = 0;
+
+    http_cache() = default;
+
+    entry *lookup(const std::string &url);
+    std::string_view contents(const entry &slot) const;
+    bool write_flash(size_t index, std::string_view body);
+    std::string_view read_flash(size_t index, uint32_t size) const;
+
+#ifdef HTTP_CACHE_FLASH_OFFSET
+    absolute_time_t last_flash_write = nil_time;
+#endif
+};
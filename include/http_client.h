@@ -1,17 +1,27 @@
 #pragma once
 #include "tcp_client.h"
 #include "tcp_tls_client.h"
+#include "tcp_pool.h"
 #include <string>
 #include <string_view>
 #include <charconv>
 #include <map>
 #include <vector>
 
-#include "LUrlParser.h"
+#include "url_view.h"
+#include "inflate.h"
+#include "websocket.h"
+#include "http_cache.h"
 
 #include "logger.h"
 
 #include <algorithm>
+#include <memory>
+
+// Gzip senders may use the full 32 KiB window, so only lower this for servers known to use less
+#ifndef HTTP_INFLATE_WINDOW_BITS
+#define HTTP_INFLATE_WINDOW_BITS INFLATE_MAX_WINDOW_BITS
+#endif
 
 bool iequals(const std::string& a, const std::string& b);
 
@@ -59,15 +69,30 @@ public:
 
     void parse(const std::string &data) {
         debug1("Parsing http response:\n");
+        if(state == parse_state::body) {
+            parse_body(data);
+            return;
+        }
+        if(state == parse_state::done) {
+            error("http_response: %u bytes after the response\n", data.size());
+            overrun = true;
+            delimited = false;
+            return;
+        }
 
-        size_t line_start = 0, line_end = data.find("\r\n");
-        while(line_end != std::string::npos) {
-            parse_line({data.begin() + line_start, data.begin() + line_end});
+        // Header lines may be split between reads, so hold on to a partial line until the rest arrives
+        this->data += data;
+        size_t line_start = 0, line_end = this->data.find("\r\n");
+        while(line_end != std::string::npos && state != parse_state::body && state != parse_state::done) {
+            parse_line({this->data.begin() + line_start, this->data.begin() + line_end});
             line_start = line_end + 2;
-            line_end = data.find("\r\n", line_start);
+            line_end = this->data.find("\r\n", line_start);
         }
-        if(line_start < data.size()) {
-            parse_line({data.begin() + line_start, data.end()});
+        if(state == parse_state::body) {
+            parse_body({this->data.begin() + line_start, this->data.end()});
+            this->data.clear();
+        } else {
+            this->data.erase(0, line_start);
         }
     }
 
@@ -97,12 +122,15 @@ public:
         case parse_state::headers:{
             debug1("Parsing header\n");
             if(line.size() == 0) {
-                debug("Empty header, transition to %s\n", content_length > 0 ? "body" : "done");
-                if(content_length == 0) {
+                debug("Empty header, transition to %s\n", content_length > 0 || chunked ? "body" : "done");
+                // 1xx, 204 and 304 responses never have a body
+                if(status_code / 100 == 1 || status_code == 204 || status_code == 304 || (content_length == 0 && !chunked)) {
                     state = parse_state::done;
-                } else if(content_length > 0) {
+                    delimited = true;
+                } else if(chunked || content_length > 0) {
                     state = parse_state::body;
                 } else {
+                    // The body runs until the server closes, so the connection can't be reused
                     error1("No content length!\n");
                     state = parse_state::done;
                 }
@@ -115,16 +143,16 @@ public:
             headers[key] = value;
             if(iequals(key, "Content-Length")) {
                 std::from_chars(line.begin() + token_end + 2, line.end(), content_length);
+            } else if(iequals(key, "Transfer-Encoding")) {
+                // chunked is always the last coding when present
+                chunked = value.size() >= 7 && iequals(value.substr(value.size() - 7), "chunked");
+            } else if(iequals(key, "Content-Encoding")) {
+                create_decoder(value);
             }
             break;
         }
         case parse_state::body:
-            debug("Parsing body:\n%s\n", line.data());
-            body += line;
-            if(body.size() == content_length) {
-                debug1("Transition to done\n");
-                state = parse_state::done;
-            }
+            parse_body(line);
             break;
         default:
             error1("Shouldn't happen? parse_state == done\n");
@@ -136,6 +164,16 @@ public:
         return headers;
     }
 
+    // Case insensitive header lookup, returns nullptr if the header is missing
+    const std::string *find_header(const std::string &key) const {
+        for(auto iter = headers.cbegin(); iter != headers.cend(); iter++) {
+            if(iequals(iter->first, key)) {
+                return &iter->second;
+            }
+        }
+        return nullptr;
+    }
+
     uint16_t status() const {
         return status_code;
     }
@@ -152,16 +190,169 @@ public:
         return body;
     }
 
+    // True if the server answered 304 Not Modified and the body came from the http_cache
+    bool from_cache() const {
+        return from_cache_;
+    }
+
+    // True once the whole response was read and its end was given by its framing, which
+    // is what it takes for the connection to carry another request
+    bool complete() const {
+        return state == parse_state::done && delimited;
+    }
+
     void add_data(std::string data) {
         this->data += data;
     }
 
 private:
+    // Where a chunked body is: at a chunk size line, in a chunk's data, at the line break
+    // after the data or in the trailer
+    enum class chunk_state {
+        size,
+        data,
+        data_end,
+        trailer
+    };
+
     uint16_t status_code;
     int content_length = -1;
+    bool chunked = false, delimited = false, overrun = false;
+    chunk_state chunk = chunk_state::size;
+    size_t chunk_remaining = 0;
+    std::string chunk_line;
+    size_t body_received = 0;
+    int64_t decode_time_us = 0;
+    bool from_cache_ = false;
     std::string protocol, status_text, body, data;
     std::map<std::string, std::string> headers;
+    std::unique_ptr<inflater> decoder;
     parse_state state;
+
+    void create_decoder(const std::string &encoding) {
+        if(iequals(encoding, "gzip")) {
+            decoder = std::make_unique<inflater>(inflater::format::gzip, HTTP_INFLATE_WINDOW_BITS);
+        } else if(iequals(encoding, "deflate")) {
+            decoder = std::make_unique<inflater>(inflater::format::zlib, HTTP_INFLATE_WINDOW_BITS);
+        } else {
+            if(!iequals(encoding, "identity")) {
+                error("Unsupported Content-Encoding '%s'\n", encoding.c_str());
+            }
+            return;
+        }
+        decoder->on_output([this](std::span<const uint8_t> decoded) {
+            body.append((const char*)decoded.data(), decoded.size());
+        });
+    }
+
+    // body is always the decoded body, content_length and body_received count the bytes on the wire
+    void parse_body(std::string_view input) {
+        if(chunked) {
+            parse_chunked(input);
+            return;
+        }
+        size_t remaining = content_length - body_received;
+        if(input.size() > remaining) {
+            // More than the response, whatever it is the connection is out of step
+            error("http_response: %u bytes past the end of the body\n", input.size() - remaining);
+            overrun = true;
+        }
+        input = input.substr(0, std::min(input.size(), remaining));
+        body_received += input.size();
+        if(decode_body(input) && body_received == content_length) {
+            finish_body();
+        }
+    }
+
+    // Chunk sizes are hex, optionally followed by ";extensions"
+    void parse_chunked(std::string_view input) {
+        while(state == parse_state::body && !input.empty()) {
+            if(chunk == chunk_state::data) {
+                size_t count = std::min(input.size(), chunk_remaining);
+                body_received += count;
+                chunk_remaining -= count;
+                if(!decode_body(input.substr(0, count))) {
+                    return;
+                }
+                input.remove_prefix(count);
+                if(chunk_remaining == 0) {
+                    chunk = chunk_state::data_end;
+                }
+                continue;
+            }
+            // The other states read a line at a time
+            size_t line_end = input.find('\n');
+            chunk_line.append(input.substr(0, line_end));
+            if(line_end == std::string_view::npos) {
+                return;
+            }
+            input.remove_prefix(line_end + 1);
+            if(!chunk_line.empty() && chunk_line.back() == '\r') {
+                chunk_line.pop_back();
+            }
+            if(chunk == chunk_state::size) {
+                size_t size = 0;
+                auto [end, ec] = std::from_chars(chunk_line.data(), chunk_line.data() + chunk_line.size(), size, 16);
+                if(ec != std::errc() || (end != chunk_line.data() + chunk_line.size() && *end != ';' && *end != ' ')) {
+                    error("http_response: bad chunk size '%s'\n", chunk_line.c_str());
+                    fail_body();
+                    return;
+                }
+                chunk_remaining = size;
+                chunk = size > 0 ? chunk_state::data : chunk_state::trailer;
+            } else if(chunk == chunk_state::data_end) {
+                if(!chunk_line.empty()) {
+                    error1("http_response: chunk data longer than its size\n");
+                    fail_body();
+                    return;
+                }
+                chunk = chunk_state::size;
+            } else if(chunk_line.empty()) {
+                // The empty line after the trailer fields ends the body
+                finish_body();
+            }
+            chunk_line.clear();
+        }
+        if(state == parse_state::done && !input.empty()) {
+            error("http_response: %u bytes past the end of the body\n", input.size());
+            overrun = true;
+        }
+    }
+
+    // False if decoding failed, which ends the response
+    bool decode_body(std::string_view data) {
+        if(!decoder) {
+            body.append(data);
+            return true;
+        }
+        absolute_time_t start = get_absolute_time();
+        inflater::status result = decoder->write({(const uint8_t*)data.data(), data.size()});
+        decode_time_us += absolute_time_diff_us(start, get_absolute_time());
+        if(result == inflater::status::error) {
+            error1("Failed to decode response body\n");
+            fail_body();
+            return false;
+        }
+        return true;
+    }
+
+    void finish_body() {
+        if(decoder) {
+            info("Decoded body: %u bytes on the wire, %u bytes decoded in %lld us\n", body_received, body.size(), decode_time_us);
+            decoder.reset();
+        }
+        debug1("Transition to done\n");
+        state = parse_state::done;
+        delimited = !overrun;
+    }
+
+    // Gives up on the body, the rest of it may still be on its way
+    void fail_body() {
+        decoder.reset();
+        body.clear();
+        state = parse_state::done;
+        delimited = false;
+    }
 };
 
 // class http_client {
@@ -182,7 +373,7 @@ private:
 //
 //     void get(std::string target) {
 //         current_request = {"GET", target};
-//         current_request.add_header("Host", host_);
+//         current_request.add_header("Host", std::string(URL.host));
 //         current_request.add_header("User-Agent", "pico");
 //         send_request();
 //     }
@@ -214,7 +405,7 @@ private:
 //
 //         if(!tcp->ready()) {
 //             tcp->on_connected(std::bind(&http_client::tcp_connected_callback, this));
-//             tcp->connect(host_, port_);
+//             tcp->connect(std::string(URL.host), URL.port);
 //         } else {
 //             tcp_connected_callback();
 //         }
@@ -243,17 +434,31 @@ private:
 
 class http_client {
 public:
-    http_client(std::string url): host_(""), url_(url), port_(-1) {
+    http_client(std::string url): tcp(nullptr), url_(url) {
+        debug("http_client Parsing URL '%s'\n", url_.c_str());
+        URL = url_view::parse(url_);
+        init();
+    }
+
+    // Uses an already parsed URL, which must outlive the client
+    http_client(url_view url): tcp(nullptr), URL(url) {
         init();
     }
 
-    http_client(http_client&&) = default;
+    // URL holds views into url_, so the client cannot be moved
+    http_client(http_client&&) = delete;
 
-    http_client& operator=(http_client&&) = default;
+    http_client& operator=(http_client&&) = delete;
 
     ~http_client() {
         if(tcp) {
-            delete tcp;
+            if(reusable()) {
+                tcp_pool::instance().release(URL.scheme, URL.host, URL.port, tcp);
+            } else {
+                tcp->on_closed([](err_t){});
+                tcp->close(ERR_CLSD);
+                delete tcp;
+            }
         }
         debug1("~http_client\n");
     }
@@ -262,12 +467,32 @@ public:
         send_request("GET", target);
     }
 
+    // Sends a websocket upgrade request; on a 101 response take the connection with release_tcp_client()
+    void upgrade(std::string target, ws::deflate_options deflate = {}) {
+        current_request = {"GET", target};
+        if(deflate.enabled) {
+            current_request.add_header("Sec-WebSocket-Extensions", deflate.offer());
+        }
+        upgrade_ = true;
+        send_request();
+    }
+
+    // Extension parameters the server accepted in its upgrade response
+    ws::deflate_options negotiated_deflate() const {
+        const std::string *extensions = current_response.find_header("Sec-WebSocket-Extensions");
+        if(extensions) {
+            return ws::deflate_options::negotiate(*extensions);
+        }
+        return {};
+    }
+
     void post(std::string target, std::string body = "") {
         send_request("POST", target, body);
     }
 
     void send_request(std::string method, std::string target, std::string body = "") {
         current_request = {method, target, body};
+        upgrade_ = false;
         send_request();
     }
 
@@ -297,66 +522,129 @@ public:
         return std::move(to_return);
     }
 
-    LUrlParser::ParseURL get_parsed_url() const {
+    url_view get_parsed_url() const {
         return URL;
     }
 
 private:
     tcp_base *tcp;
-    bool response_ready = false;
+    bool response_ready = false, request_pending = false, upgrade_ = false;
     http_request current_request;
     http_response current_response;
-    std::string host_, url_;
-    int port_;
-    LUrlParser::ParseURL URL;
+    std::string url_;
+    url_view URL;
     std::function<void()> user_response_callback;
 
     bool init() {
-        debug("http_client::init Parsing URL '%s'\n", url_.c_str());
-        URL = LUrlParser::ParseURL::parseURL(url_);
-        if(!URL.isValid()) {
-            error("Invalid URL: %s\n", url_.c_str());
+        if(!URL.valid() || URL.port == 0) {
+            error("Invalid URL (status %d)\n", (int)URL.status);
+            return false;
+        }
+        debug("http_client::init got host '%.*s' port %d\n", URL.host.size(), URL.host.data(), URL.port);
+        tcp = tcp_pool::instance().acquire(URL.scheme, URL.host, URL.port);
+        if(!tcp) {
+            error1("http_client::init failed to create new tcp_client\n");
+            return false;
+        }
+        return true;
+    }
+
+    // A connection can go back to the pool if it is idle, the last response was read to its
+    // delimited end and the server did not ask to close it
+    bool reusable() const {
+        if(request_pending || !tcp->connected()) {
             return false;
         }
+        // ready_ is only set once a request was made
+        if(current_request.ready_ && !current_response.complete()) {
+            return false;
+        }
+        const std::string *connection = current_response.find_header("Connection");
+        return !connection || !iequals(*connection, "close");
+    }
+
+    std::string cache_key() const {
+        return std::string(URL.scheme) + "://" + std::string(URL.host) + ":" + std::to_string(URL.port) + current_request.target_;
+    }
+
+    bool cacheable() const {
+        return !upgrade_ && current_request.method_ == "GET";
+    }
+
+    void add_cache_validators() {
+        const http_cache::entry *cached = http_cache::instance().find(cache_key());
+        if(!cached) {
+            return;
+        }
+        if(cached->etag.size() > 0) {
+            current_request.add_header("If-None-Match", cached->etag);
+        }
+        if(cached->last_modified.size() > 0) {
+            current_request.add_header("If-Modified-Since", cached->last_modified);
+        }
+    }
 
-        host_ = URL.host_;
-        if(URL.port_.size() > 0)
-            URL.getPort(&port_);
-        debug("http_client::init got host '%s'\n", host_.c_str());
-        if(URL.scheme_ == "https" || URL.scheme_ == "wss") {
-            debug1("http_client::init creating new tcp_tls_client\n");
-            tcp = new tcp_tls_client();
-            if(port_ == -1) {
-                port_ = 443;
+    // False if the response was replaced by a new request, which answers the caller instead
+    bool update_cache() {
+        if(current_response.status() == 304) {
+            if(http_cache::instance().load(cache_key(), current_response.body)) {
+                debug("http_client serving %s from cache\n", current_request.target_.c_str());
+                // Callers see the response the cached body came from
+                current_response.status_code = 200;
+                current_response.status_text = "OK";
+                current_response.from_cache_ = true;
+                return true;
             }
-        } else {
-            debug1("http_client::init creating new tcp_client\n");
-            tcp = new tcp_client();
-            if(port_ == -1) {
-                port_ = 80;
+            // The entry went away between the request and the 304, ask for the whole body
+            http_cache::instance().erase(cache_key());
+            size_t validators = current_request.headers.erase("If-None-Match") + current_request.headers.erase("If-Modified-Since");
+            if(validators == 0) {
+                error("http_client: 304 for %s without a conditional request\n", current_request.target_.c_str());
+                return true;
             }
-        }
-        if(!tcp) {
-            error1("http_client::init failed to create new tcp_client\n");
+            info("http_client: %s is no longer cached, requesting it again\n", current_request.target_.c_str());
+            if(!reusable()) {
+                // send_request reconnects a closed client
+                tcp->close(ERR_CLSD);
+            }
+            send_request();
             return false;
         }
+        if(current_response.status() != 200) {
+            return true;
+        }
+        const std::string *etag = current_response.find_header("ETag");
+        const std::string *last_modified = current_response.find_header("Last-Modified");
+        const std::string *cache_control = current_response.find_header("Cache-Control");
+        if((!etag && !last_modified) || (cache_control && cache_control->find("no-store") != std::string::npos)) {
+            return true;
+        }
+        http_cache::instance().store(cache_key(), etag ? *etag : "", last_modified ? *last_modified : "", current_response.body);
         return true;
     }
 
     void send_request() {
         debug("http_client::send_request (tcp = %p)\n", tcp);
         response_ready = false;
+        request_pending = true;
         current_response = {};
         trace1("Adding headers\n");
-        current_request.add_header("Host", host_);
+        current_request.add_header("Host", std::string(URL.host));
         current_request.add_header("User-Agent", "pico");
         if(current_request.body_.size() > 0) {
             current_request.add_header("Content-Length", std::to_string(current_request.body_.size()));
         }
-        current_request.add_header("Connection", "Upgrade");
-        current_request.add_header("Upgrade", "websocket");
-        current_request.add_header("Sec-WebSocket-Key", "8xtVmuvomB2taGWDXBxVMw==");
-        current_request.add_header("Sec-WebSocket-Version", "13");
+        if(upgrade_) {
+            current_request.add_header("Connection", "Upgrade");
+            current_request.add_header("Upgrade", "websocket");
+            current_request.add_header("Sec-WebSocket-Key", "8xtVmuvomB2taGWDXBxVMw==");
+            current_request.add_header("Sec-WebSocket-Version", "13");
+        } else {
+            current_request.add_header("Accept-Encoding", "gzip, deflate");
+        }
+        if(cacheable()) {
+            add_cache_validators();
+        }
         trace1("Adding callbacks\n");
         tcp->on_receive(std::bind(&http_client::tcp_recv_callback, this));
         tcp->on_closed(std::bind(&http_client::tcp_closed_callback, this));
@@ -369,7 +657,7 @@ private:
         if(!tcp->connected()) {
             trace1("Connecting TCP\n");
             tcp->on_connected(std::bind(&http_client::tcp_connected_callback, this));
-            tcp->connect(host_, port_);
+            tcp->connect(std::string(URL.host), URL.port);
         } else {
             trace1("Already connected\n");
             tcp_connected_callback();
@@ -391,6 +679,10 @@ private:
         current_response.parse(data);
         response_ready = current_response.state == http_response::parse_state::done;
         if(response_ready) {
+            request_pending = false;
+            if(cacheable() && !update_cache()) {
+                return;
+            }
             tcp->on_receive([](){});
             user_response_callback();
         }
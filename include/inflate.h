@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <functional>
+
+// Largest window allowed by RFC 1951. Senders may reference this far back, so a
+// smaller window only works when the sender is known to limit itself (e.g. the
+// server_max_window_bits parameter of permessage-deflate).
+#ifndef INFLATE_MAX_WINDOW_BITS
+#define INFLATE_MAX_WINDOW_BITS 15
+#endif
+
+#ifndef INFLATE_MIN_WINDOW_BITS
+#define INFLATE_MIN_WINDOW_BITS 8
+#endif
+
+// Streaming DEFLATE decoder (RFC 1951) with optional zlib (RFC 1950) or gzip (RFC 1952) framing.
+// Input may be split at any byte boundary; decoded bytes are handed to the output callback as
+// spans into the sliding window, which is the only buffer the decoder allocates.
+class inflater {
+public:
+    enum class format {
+        raw,
+        zlib,
+        gzip
+    };
+
+    enum class status {
+        ok,     // all input consumed, more is expected
+        done,   // end of stream reached, trailing input was ignored
+        error
+    };
+
+    inflater(format fmt, uint8_t window_bits = INFLATE_MAX_WINDOW_BITS);
+
+    void on_output(std::function<void(std::span<const uint8_t>)> callback) {
+        output_callback = callback;
+    }
+
+    status write(std::span<const uint8_t> input);
+
+    // Starts a new stream. With keep_window the previous output stays available as history,
+    // which is what permessage-deflate context takeover needs.
+    void reset(bool keep_window = false);
+
+    bool finished() const;
+    bool failed() const;
+    size_t total_in() const;
+    size_t total_out() const;
+
+private:
+    enum class state : uint8_t {
+        header,
+        gzip_extra_length,
+        gzip_extra,
+        gzip_name,
+        gzip_comment,
+        gzip_header_crc,
+        block_header,
+        stored_header,
+        stored_copy,
+        table_sizes,
+        code_length_lengths,
+        code_lengths,
+        code_lengths_repeat,
+        codes,
+        length_extra,
+        distance,
+        distance_extra,
+        trailer,
+        done,
+        error
+    };
+
+    static constexpr int max_bits = 15;
+    static constexpr int max_literal_codes = 286;
+    static constexpr int max_distance_codes = 30;
+    static constexpr int fixed_literal_codes = 288;
+
+    struct huffman {
+        uint16_t *count;
+        uint16_t *symbol;
+    };
+
+    format requested_format, format_;
+    state state_;
+    std::unique_ptr<uint8_t[]> window;
+    uint32_t window_mask, window_pos, window_filled, flush_start;
+    std::function<void(std::span<const uint8_t>)> output_callback;
+
+    // Input bit accumulator, filled LSB first
+    const uint8_t *in_next, *in_end;
+    uint32_t bit_buffer;
+    uint8_t bit_count;
+
+    bool last_block;
+    uint8_t gzip_flags;
+    uint16_t hlit, hdist, hclen, index, pending_symbol, pending_length, header_bytes;
+    uint32_t stored_remaining, checksum, adler_b;
+    size_t total_in_, total_out_;
+
+    uint16_t lengths[max_literal_codes + max_distance_codes];
+    uint16_t literal_count[max_bits + 1], literal_symbol[fixed_literal_codes];
+    uint16_t distance_count[max_bits + 1], distance_symbol[max_distance_codes];
+    huffman literal_code{literal_count, literal_symbol};
+    huffman distance_code{distance_count, distance_symbol};
+
+    bool need(uint8_t bits);
+    uint32_t take(uint8_t bits);
+    int decode(const huffman &code);
+    static int build(huffman &code, const uint16_t *lengths, int n);
+    void build_fixed();
+
+    void end_block();
+    state gzip_next_state() const;
+
+    void put(uint8_t byte);
+    void copy(uint32_t distance, uint32_t length);
+    void flush();
+    void update_checksum(std::span<const uint8_t> data);
+
+    status fail(const char *reason);
+    status run();
+};
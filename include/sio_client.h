@@ -1,36 +1,55 @@
 #pragma once
 
 #include "eio_client.h"
+#include "eio_polling_transport.h"
 #include "http_client.h"
+#include "sio_sax.h"
+#include "sio_typed.h"
+#include "event_table.h"
+#include "circular_buffer.h"
 
 #include "nlohmann/json.hpp"
 
 #include <pico/stdlib.h>
+#include <pico/cyw43_arch.h>
 #include <hardware/watchdog.h>
 
+#include <algorithm>
+#include <array>
+#include <charconv>
 #include <map>
 #include <memory>
 #include <functional>
+#include <optional>
+#include <span>
+#include <vector>
 
-class sio_packet {
-public:
-    sio_packet(): payload(15, ' ') {}
+// Emits that can wait for an acknowledgement at the same time, per namespace
+#ifndef SIO_MAX_PENDING_ACKS
+#define SIO_MAX_PENDING_ACKS 8
+#endif
 
-    sio_packet& operator+=(const std::string &rhs) {
-        payload += rhs;
-        return *this;
-    }
+#ifndef SIO_ACK_TIMEOUT_MS
+#define SIO_ACK_TIMEOUT_MS 10000
+#endif
 
-    std::span<uint8_t> span() const {
-        return {(uint8_t*)payload.data() + 15, payload.size() - 15};
-    }
+// Emits kept per namespace while it isn't connected
+#ifndef SIO_OFFLINE_QUEUE_DEPTH
+#define SIO_OFFLINE_QUEUE_DEPTH 8
+#endif
 
-    const char* c_str() const noexcept {
-        return payload.c_str();
-    }
+// Most attachments a binary event can carry, events with more are dropped
+#ifndef SIO_MAX_ATTACHMENTS
+#define SIO_MAX_ATTACHMENTS 4
+#endif
 
-private:
-    std::string payload;
+// A binary attachment, split in two where it wraps around the receive buffer
+struct sio_attachment {
+    std::span<const uint8_t> first, second;
+
+    size_t size() const {
+        return first.size() + second.size();
+    }
 };
 
 class sio_client;
@@ -38,30 +57,121 @@ class sio_socket {
     friend class sio_client;
 public:
     void on(std::string event, std::function<void(nlohmann::json)> handler) {
-        event_handlers[event] = handler;
+        handlers[event].dom = handler;
+    }
+
+    // Streams the event's arguments to the handler without building a DOM. The handler
+    // must outlive the registration and takes precedence over a DOM handler for the event.
+    void on(std::string event, sio_event_handler *handler) {
+        event_handler &entry = handlers[event];
+        entry.owned.reset();
+        entry.sax = handler;
+    }
+
+    // Fills a T bound with json_binding<T> straight from the packet and passes it to the handler
+    template <typename T>
+    void on(std::string event, std::function<void(const T&)> handler) {
+        event_handler &entry = handlers[event];
+        entry.owned = std::make_unique<sio_typed_handler<T>>(handler);
+        entry.sax = entry.owned.get();
+    }
+
+    // Binary events get their arguments with {"_placeholder":true,"num":i} in place of
+    // attachment i. The attachments are only valid during the call, the last one points
+    // straight into the receive buffer. Takes precedence over other handlers for the event.
+    void on_binary(std::string event, std::function<void(nlohmann::json, std::span<const sio_attachment>)> handler) {
+        handlers[event].binary = handler;
     }
 
     void once(std::string event, std::function<void(nlohmann::json)> handler) {
-        event_handlers[event] = [&](nlohmann::json body) {
-            handler(body);
-            this->event_handlers.erase(event);
-        };
+        event_handler &entry = handlers[event];
+        entry.dom = handler;
+        entry.once = true;
     }
 
-    bool emit(std::string event, nlohmann::json array = nlohmann::json::array()) {
-        sio_packet packet; // Add 15 bytes at the beginning to allow underlying protocols room to write data
-        packet += "2" + (ns_ != "/" ? ns_ + "," : "");
-        if(!array.is_array()) {
-            array = {event, array};
-        } else {
-            array.insert(array.begin(), event);
+    // What an emit does to a full offline queue
+    enum class offline_policy: uint8_t {
+        drop_oldest,
+        drop_newest
+    };
+
+    // Called with ERR_OK and the server's arguments, or with ERR_TIMEOUT or ERR_CLSD and an empty array.
+    // Attachments of a binary ack are binary values in place of their placeholders.
+    using ack_callback = std::function<void(err_t, nlohmann::json)>;
+
+    // Sets the arguments of the ack the server asked for with the event whose handler is
+    // running. The ack goes out when the handler returns, with no arguments if this isn't
+    // called. Does nothing from any other handler.
+    void reply(nlohmann::json args) {
+        if(!reply_id) {
+            debug1("sio_socket::reply: the event did not ask for an ack\n");
+            return;
         }
-        packet += array.dump();
-        debug("emit:\n\tNamespace '%s'\n\tpacket: '%s'\n", ns_.c_str(), packet.c_str());
-        if(engine) {
-            return engine->send_message(packet.span());
+        reply_args = args.is_array() ? std::move(args) : nlohmann::json::array({std::move(args)});
+    }
+
+    ~sio_socket() {
+        async_context_remove_at_time_worker(cyw43_arch_async_context(), &ack_timer);
+    }
+
+    bool emit(const std::string &event, const nlohmann::json &array = nlohmann::json::array()) {
+        return emit_packet(event, array, "");
+    }
+
+    // Sends an already serialized ["event", args...] array as is, e.g. a constant payload
+    bool emit_serialized(std::string_view array) {
+        if(array.empty() || array.front() != '[') {
+            error1("sio_socket::emit_serialized: payload is not an array\n");
+            return false;
+        }
+        write_header("");
+        debug("emit:\n\tNamespace '%s'\n\tpacket: '%s%.*s'\n", ns_.c_str(), emit_buffer.c_str(), array.size(), array.data());
+        if(!engine || !connected()) {
+            emit_buffer += array;
+            return enqueue();
+        }
+        return engine->send_message({ws::bytes_of(emit_buffer), ws::bytes_of(array)});
+    }
+
+    // Asks the server to acknowledge the event. Any number of these can be in flight up to
+    // SIO_MAX_PENDING_ACKS, returns false if the table is full or the emit failed.
+    bool emit(const std::string &event, const nlohmann::json &array, ack_callback callback, uint32_t timeout_ms = SIO_ACK_TIMEOUT_MS) {
+        pending_ack *slot = nullptr;
+        for(pending_ack &ack : acks) {
+            if(!ack.callback) {
+                slot = &ack;
+                break;
+            }
+        }
+        if(!slot) {
+            error("sio_socket::emit '%s': %u acks already pending\n", event.c_str(), SIO_MAX_PENDING_ACKS);
+            return false;
         }
-        return false;
+        uint32_t id = next_ack_id++;
+        if(!emit_packet(event, array, std::to_string(id))) {
+            return false;
+        }
+        *slot = {id, make_timeout_time_ms(timeout_ms), std::move(callback)};
+        arm_ack_timer();
+        return true;
+    }
+
+    void set_offline_policy(offline_policy policy) {
+        offline_policy_ = policy;
+    }
+
+    // Emits waiting for the namespace to connect, sent in one go once it does
+    size_t offline_queued() const {
+        return offline.size();
+    }
+
+    // Emits lost to a full offline queue since the socket was created
+    uint32_t offline_dropped() const {
+        return offline_dropped_;
+    }
+
+    size_t pending_acks() const {
+        return std::count_if(acks.begin(), acks.end(), [](const pending_ack &ack) { return (bool)ack.callback; });
     }
 
     bool connected() const {
@@ -73,32 +183,314 @@ public:
     }
 
 private:
+    // Serializes the header, name and arguments one after the other into emit_buffer, so the
+    // packet is written once and handed to the engine as a single piece
+    bool emit_packet(const std::string &event, const nlohmann::json &array, std::string_view ack_id) {
+        write_header(ack_id);
+        emit_buffer += '[';
+        append_string(event);
+        if(array.is_array()) {
+            for(const nlohmann::json &arg : array) {
+                emit_buffer += ',';
+                append_json(arg);
+            }
+        } else {
+            emit_buffer += ',';
+            append_json(array);
+        }
+        emit_buffer += ']';
+        debug("emit:\n\tNamespace '%s'\n\tpacket: '%s'\n", ns_.c_str(), emit_buffer.c_str());
+        if(!engine || !connected()) {
+            return enqueue();
+        }
+        return engine->send_message(ws::bytes_of(emit_buffer));
+    }
+
+    // One slot of a circular_buffer stays empty
+    circular_buffer<std::string> offline{SIO_OFFLINE_QUEUE_DEPTH + 1};
+    offline_policy offline_policy_ = offline_policy::drop_oldest;
+    uint32_t offline_dropped_ = 0;
+
+    // Keeps the packet in emit_buffer until the namespace connects, false if it was dropped
+    bool enqueue() {
+        if(offline.full()) {
+            offline_dropped_++;
+            if(offline_policy_ == offline_policy::drop_newest) {
+                debug("sio_socket: offline queue of '%s' is full, dropping the new emit (%u dropped)\n", ns_.c_str(), offline_dropped_);
+                return false;
+            }
+            debug("sio_socket: offline queue of '%s' is full, dropping the oldest emit (%u dropped)\n", ns_.c_str(), offline_dropped_);
+            offline.get();
+        }
+        offline.put(emit_buffer);
+        return true;
+    }
+
+    // The sends happen back to back inside the connect packet's receive callback, so they
+    // leave together when it returns. Polling batches them into as few POSTs as it can.
+    void flush_offline() {
+        if(offline.empty() || !engine) {
+            return;
+        }
+        info("sio_socket: flushing %u queued emits on '%s'\n", offline.size(), ns_.c_str());
+        while(std::optional<std::string> packet = offline.get()) {
+            if(!engine->send_message(ws::bytes_of(*packet))) {
+                error("sio_socket: failed to send a queued emit on '%s'\n", ns_.c_str());
+            }
+        }
+    }
+
+    // The last packet emitted, reused so its capacity carries over
+    std::string emit_buffer;
+
+    void write_header(std::string_view ack_id, char type = '2') {
+        emit_buffer = type;
+        if(ns_ != "/") {
+            emit_buffer += ns_;
+            emit_buffer += ',';
+        }
+        emit_buffer += ack_id;
+    }
+
+    // dump() can only return a new string, so this drives the serializer it uses itself
+    // with an output adapter that appends straight to emit_buffer
+    void append_json(const nlohmann::json &value) {
+        nlohmann::detail::serializer<nlohmann::json> serializer(nlohmann::detail::output_adapter<char>(emit_buffer), ' ');
+        serializer.dump(value, false, false, 0);
+    }
+
+    // Event names rarely need escaping, those that do go through the serializer
+    void append_string(const std::string &text) {
+        bool plain = std::none_of(text.begin(), text.end(), [](char c) { return c == '"' || c == '\\' || (uint8_t)c < 0x20; });
+        if(!plain) {
+            append_json(text);
+            return;
+        }
+        emit_buffer += '"';
+        emit_buffer += text;
+        emit_buffer += '"';
+    }
+
     sio_socket() = default;
     sio_socket(eio_client *engine_ref, std::string ns): ns_(ns), engine(engine_ref) {
 
     }
+
+    struct pending_ack {
+        uint32_t id = 0;
+        absolute_time_t deadline = nil_time;
+        ack_callback callback;
+    };
+    std::array<pending_ack, SIO_MAX_PENDING_ACKS> acks;
+    uint32_t next_ack_id = 0;
+    // Fires at the earliest ack deadline
+    async_at_time_worker_t ack_timer{.do_work = ack_timer_callback, .user_data = this};
+
+    // Ack the server asked for with the event being handled, and its arguments
+    std::optional<uint32_t> reply_id;
+    nlohmann::json reply_args;
+
+    void begin_reply(std::optional<uint32_t> id) {
+        reply_id = id;
+        reply_args = nlohmann::json::array();
+    }
+
+    // 3[/namespace,]<id>[args...]
+    void end_reply() {
+        if(!reply_id) {
+            return;
+        }
+        write_header(std::to_string(*reply_id), '3');
+        reply_id.reset();
+        append_json(reply_args);
+        reply_args = nullptr;
+        debug("ack:\n\tNamespace '%s'\n\tpacket: '%s'\n", ns_.c_str(), emit_buffer.c_str());
+        // An ack for an earlier connection means nothing to the server
+        if(!engine || !connected()) {
+            debug1("sio_socket: not connected, dropping the ack\n");
+            return;
+        }
+        engine->send_message(ws::bytes_of(emit_buffer));
+    }
+
+    // Swaps every {"_placeholder":true,"num":i} for the bytes of attachment i
+    static void fill_placeholders(nlohmann::json &value, std::span<const sio_attachment> attachments) {
+        if(value.is_object()) {
+            auto placeholder = value.find("_placeholder");
+            auto num = value.find("num");
+            if(placeholder != value.end() && *placeholder == true && num != value.end() && num->is_number_unsigned() && num->get<size_t>() < attachments.size()) {
+                const sio_attachment &attachment = attachments[num->get<size_t>()];
+                std::vector<uint8_t> bytes;
+                bytes.reserve(attachment.size());
+                bytes.insert(bytes.end(), attachment.first.begin(), attachment.first.end());
+                bytes.insert(bytes.end(), attachment.second.begin(), attachment.second.end());
+                value = nlohmann::json::binary(std::move(bytes));
+                return;
+            }
+        }
+        if(value.is_object() || value.is_array()) {
+            for(nlohmann::json &item : value) {
+                fill_placeholders(item, attachments);
+            }
+        }
+    }
+
+    void binary_ack_received(uint32_t id, nlohmann::json args, std::span<const sio_attachment> attachments) {
+        fill_placeholders(args, attachments);
+        ack_received(id, std::move(args));
+    }
+
+    void ack_received(uint32_t id, nlohmann::json args) {
+        for(pending_ack &ack : acks) {
+            if(ack.callback && ack.id == id) {
+                ack_callback callback = std::move(ack.callback);
+                ack = {};
+                arm_ack_timer();
+                callback(ERR_OK, std::move(args));
+                return;
+            }
+        }
+        debug("sio_socket: ack %u is not pending (timed out?)\n", id);
+    }
+
+    // Completes every pending ack that is due, or all of them with a close
+    void fail_acks(err_t reason) {
+        for(pending_ack &ack : acks) {
+            if(ack.callback && (reason != ERR_TIMEOUT || time_reached(ack.deadline))) {
+                debug("sio_socket: ack %u failed (%d)\n", ack.id, reason);
+                ack_callback callback = std::move(ack.callback);
+                ack = {};
+                callback(reason, nlohmann::json::array());
+            }
+        }
+        arm_ack_timer();
+    }
+
+    void arm_ack_timer() {
+        async_context_t *context = cyw43_arch_async_context();
+        async_context_remove_at_time_worker(context, &ack_timer);
+        absolute_time_t earliest = at_the_end_of_time;
+        for(const pending_ack &ack : acks) {
+            if(ack.callback && absolute_time_diff_us(ack.deadline, earliest) > 0) {
+                earliest = ack.deadline;
+            }
+        }
+        if(!is_at_the_end_of_time(earliest)) {
+            async_context_add_at_time_worker_at(context, &ack_timer, earliest);
+        }
+    }
+
+    static void ack_timer_callback(async_context_t *context, async_at_time_worker_t *worker) {
+        ((sio_socket*)worker->user_data)->fail_acks(ERR_TIMEOUT);
+    }
     eio_client *engine;
     std::string ns_, sid_;
-    std::map<std::string, std::function<void(nlohmann::json)>> event_handlers;
-\
+
+    struct event_handler {
+        std::function<void(nlohmann::json)> dom;
+        std::function<void(nlohmann::json, std::span<const sio_attachment>)> binary;
+        sio_event_handler *sax = nullptr;
+        // Set when the sax handler was created by on<T>
+        std::unique_ptr<sio_event_handler> owned;
+        bool once = false;
+    };
+    // Frozen on the first dispatch, after which lookups are a hash and a binary search
+    event_table<event_handler> handlers;
+
+    // The entry stays put while its handler runs (see event_table). A once handler is
+    // removed before it runs, so one it registers for the same event survives.
+    void call(std::string_view event, nlohmann::json body) {
+        event_handler *entry = handlers.find(event);
+        if(!entry || !entry->dom) {
+            return;
+        }
+        if(entry->once) {
+            std::function<void(nlohmann::json)> handler = std::move(entry->dom);
+            handlers.erase(event);
+            handler(std::move(body));
+            return;
+        }
+        entry->dom(std::move(body));
+    }
+
     void connect_callback(nlohmann::json body) {
         debug("sio_socket::connect_callback\n%s\n", body.dump(4).c_str());
         if(body.contains("sid")){
             debug1("setting sid...\n");
             sid_ = body["sid"];
         }
+        // Before the handler, so queued emits go out ahead of the ones it makes
+        flush_offline();
 
-        if(event_handlers.find("connect") != event_handlers.end()){
-            event_handlers["connect"](body);
-        }
+        call("connect", body);
     }
 
     void disconnect_callback(nlohmann::json body = nlohmann::json::array()) {
         debug("sio_socket::disconnect_callback\n%s\n", body.dump(4).c_str());
 
-        if(event_handlers.find("disconnect") != event_handlers.end()){
-            event_handlers["disconnect"](body);
+        fail_acks(ERR_CLSD);
+        call("disconnect", body);
+    }
+
+    // array is the event's JSON array as it is in the packet, ack_id set if the server wants an ack
+    void dispatch(std::string_view array, std::optional<uint32_t> ack_id) {
+        begin_reply(ack_id);
+        dispatch_event(array);
+        end_reply();
+    }
+
+    void dispatch_event(std::string_view array) {
+        std::string_view event = sio_event_sax::event_name(array);
+        size_t heap_before = heap_in_use();
+        handlers.freeze();
+        event_handler *entry = handlers.find(event);
+        if(entry && entry->sax) {
+            sio_event_sax parser(entry->sax);
+            bool ok = parser.parse(array);
+            debug("sio_socket::dispatch '%.*s' (sax%s): peak heap +%d bytes\n", event.size(), event.data(), ok ? "" : ", failed", (int)(parser.peak_heap() - heap_before));
+            return;
+        }
+        if(!event.empty() && (!entry || !entry->dom)) {
+            debug("sio_socket::dispatch no handler for '%.*s'\n", event.size(), event.data());
+            return;
         }
+        nlohmann::json body = nlohmann::json::parse(array, nullptr, false);
+        if(body.is_discarded()) {
+            error1("sio_socket::dispatch invalid event JSON\n");
+            return;
+        }
+        debug("sio_socket::dispatch '%.*s' (dom): peak heap +%d bytes\n", event.size(), event.data(), (int)(heap_in_use() - heap_before));
+        event_callback(body);
+    }
+
+    void binary_event_callback(nlohmann::json array, std::span<const sio_attachment> attachments, std::optional<uint32_t> ack_id) {
+        begin_reply(ack_id);
+        dispatch_binary_event(std::move(array), attachments);
+        end_reply();
+    }
+
+    // Without a binary handler the event goes to the DOM handler, placeholders and all
+    void dispatch_binary_event(nlohmann::json array, std::span<const sio_attachment> attachments) {
+        if(array.size() == 0 || !array[0].is_string()) {
+            error1("sio_socket: binary event without a name\n");
+            return;
+        }
+        std::string event = array[0];
+        array.erase(0);
+        debug("sio_socket::binary_event_callback for event '%s' with %u attachments\n", event.c_str(), attachments.size());
+        handlers.freeze();
+        event_handler *entry = handlers.find(event);
+        if(!entry || !entry->binary) {
+            call(event, std::move(array));
+            return;
+        }
+        if(entry->once) {
+            std::function<void(nlohmann::json, std::span<const sio_attachment>)> handler = std::move(entry->binary);
+            handlers.erase(event);
+            handler(std::move(array), attachments);
+            return;
+        }
+        entry->binary(std::move(array), attachments);
     }
 
     void event_callback(nlohmann::json array) {
@@ -109,9 +501,7 @@ private:
         std::string event = array[0];
         array.erase(0);
         debug("sio_socket::event_callback for event '%s'\n", event.c_str());
-        if(event_handlers.find(event) != event_handlers.end()) {
-            event_handlers[event](array);
-        }
+        call(event, std::move(array));
     }
 };
 
@@ -131,20 +521,41 @@ public:
         binary_ack
     };
 
+    enum class transport_type: uint8_t {
+        // Upgrade request straight away, falls back to polling if the server can't do websocket
+        websocket,
+        // Handshake over HTTP long-polling, upgraded to websocket if the server offers it
+        polling
+    };
+
     sio_client(std::string url, std::map<std::string, std::string> query)
         : raw_url(url)
         , engine(nullptr)
-        , reconnect_time(nil_time)
     {
-        http = new http_client(url);
-        query_string = "?EIO=4&transport=websocket";
-        for(std::map<std::string, std::string>::const_iterator iter = query.cbegin(); iter != query.cend(); iter++) {
-            query_string += "&" + iter->first + "=" + iter->second;
-        }
-        http->on_response(std::bind(&sio_client::http_response_callback, this));
+        this->url = url_view::parse(raw_url);
+        init(query);
+    }
+
+    // The parsed url must outlive the client, e.g. a "..."_url literal
+    sio_client(url_view url, std::map<std::string, std::string> query)
+        : url(url)
+        , engine(nullptr)
+    {
+        init(query);
     }
 
+    // url may hold views into raw_url, and the workers point back at the client, so it can
+    // be neither copied nor moved
+    sio_client(const sio_client&) = delete;
+    sio_client(sio_client&&) = delete;
+
+    sio_client& operator=(const sio_client&) = delete;
+    sio_client& operator=(sio_client&&) = delete;
+
     ~sio_client() {
+        async_context_t *context = cyw43_arch_async_context();
+        async_context_remove_at_time_worker(context, &reconnect_worker);
+        async_context_remove_when_pending_worker(context, &work_worker);
         for(auto iter = namespace_connections.begin(); iter != namespace_connections.end(); iter++) {
             iter->second.reset();
         }
@@ -159,11 +570,17 @@ public:
     }
 
     void open() {
+        if(transport == transport_type::polling) {
+            delete http;
+            http = nullptr;
+            attach_engine(new eio_client(new eio_polling_transport(url, "/socket.io/" + query_string)));
+            return;
+        }
         if(!http) {
             error1("sio_client::open: http_client is nullptr\n");
             return;
         }
-        http->get("/socket.io/" + query_string);
+        http->upgrade("/socket.io/" + query_string + "&transport=websocket", deflate_offer);
     }
 
     void connect(std::string ns = "/") {
@@ -171,9 +588,8 @@ public:
             error1("connect: Engine not initialized!\n");
             return;
         }
-        sio_packet payload;
-        payload += "0" + (ns != "/" ? ns + "," : "");
-        engine->send_message(payload.span());
+        std::string packet = "0" + (ns != "/" ? ns + "," : "");
+        engine->send_message(ws::bytes_of(packet));
     }
 
     void disconnect(std::string ns = "/") {
@@ -187,9 +603,8 @@ public:
             namespace_connections[ns]->disconnect_callback({"io client disconnect"});
             namespace_connections[ns].reset();
             namespace_connections.erase(ns);
-            sio_packet packet;
-            packet += "1" + (ns != "/" ? ns + "," : "");
-            engine->send_message(packet.span());
+            std::string packet = "1" + (ns != "/" ? ns + "," : "");
+            engine->send_message(ws::bytes_of(packet));
         }
     }
 
@@ -205,13 +620,24 @@ public:
         user_open_callback = callback;
     }
 
+    // Offers permessage-deflate on the next upgrade, asking the server to use at most a 2^window_bits window
+    void offer_deflate(uint8_t window_bits = WS_DEFLATE_WINDOW_BITS) {
+        deflate_offer.enabled = true;
+        deflate_offer.server_max_window_bits = window_bits;
+    }
+
+    // Takes effect on the next open or reconnect
+    void set_transport(transport_type type) {
+        transport = type;
+    }
+
     bool ready() {
         return open_;
     }
 
     void reconnect() {
         debug1("Reconnecting...\n");
-        reconnect_time = nil_time;
+        async_context_remove_at_time_worker(cyw43_arch_async_context(), &reconnect_worker);
         if(engine != nullptr) {
             delete engine;
             engine = nullptr;
@@ -220,7 +646,7 @@ public:
             delete http;
         }
         debug1("Creating new http_client\n");
-        http = new http_client(raw_url);
+        http = new http_client(url);
         http->on_response(std::bind(&sio_client::http_response_callback, this));
         std::function<void()> old_open_callback = user_open_callback;
         on_open([&, old_open_callback](){
@@ -238,24 +664,37 @@ public:
         }
     }
 
-    // Starts the sio_client main loop
+    // Runs work on the async_context, where the client's callbacks run, as soon as it is free.
+    // Not for use from an interrupt.
+    void post(std::function<void()> work) {
+        cyw43_arch_lwip_begin();
+        posted.push_back(std::move(work));
+        cyw43_arch_lwip_end();
+        async_context_set_work_pending(cyw43_arch_async_context(), &work_worker);
+    }
+
+    // Starts the sio_client main loop. Everything happens in async_context workers, timers
+    // and the lwIP background worker; between them the core sleeps.
     void run() {
         info1("Setting up watchdog...\n");
         watchdog_enable(8000000, true);
         debug1("Setting up alarm to extend watchdog to 30 seconds\n");
         watchdog_extender = add_alarm_in_us(7333333ull, alarm_callback, NULL, false);
         debug1("opening socket.io connection...\n");
+        cyw43_arch_lwip_begin();
         open();
+        cyw43_arch_lwip_end();
+        async_context_t *context = cyw43_arch_async_context();
         while(true) {
-            if(!is_nil_time(reconnect_time) && time_reached(reconnect_time)) {
-                alarms_fired = 0;
-                watchdog_update();
-                debug1("Setting up alarm to extend watchdog to 30 seconds\n");
-                watchdog_extender = add_alarm_in_us(7333333ull, alarm_callback, NULL, false);
-                this->reconnect();
-            } else {
-                sleep_ms(100);
-            }
+            // Services a poll context, a background context does its work from interrupts
+            async_context_poll(context);
+            // Flash writes can't happen in that interrupt, this is the thread they run from
+            http_cache::instance().persist();
+#ifdef HTTP_CACHE_FLASH_OFFSET
+            async_context_wait_for_work_until(context, make_timeout_time_ms(HTTP_CACHE_PERSIST_POLL_MS));
+#else
+            async_context_wait_for_work_until(context, at_the_end_of_time);
+#endif
         }
     }
 
@@ -265,49 +704,200 @@ private:
     std::map<std::string, std::unique_ptr<sio_socket>> namespace_connections;
     std::function<void()> user_open_callback;
     std::function<void(err_t)> user_close_callback;
-    std::string raw_url, query_string;
+    std::string raw_url, query_string, packet;
+    url_view url;
+    ws::deflate_options deflate_offer;
+    transport_type transport = transport_type::websocket;
     bool open_ = false;
-    absolute_time_t reconnect_time;
     alarm_id_t watchdog_extender = 0;
+    async_at_time_worker_t reconnect_worker{.do_work = reconnect_worker_callback, .user_data = this};
+    async_when_pending_worker_t work_worker{.do_work = work_worker_callback, .user_data = this};
+    // Work from post, swapped out before it runs
+    std::vector<std::function<void()>> posted;
+
+    void schedule_reconnect(uint32_t ms) {
+        async_context_t *context = cyw43_arch_async_context();
+        async_context_remove_at_time_worker(context, &reconnect_worker);
+        async_context_add_at_time_worker_in_ms(context, &reconnect_worker, ms);
+        debug("Scheduled reconnect in %u ms\n", ms);
+    }
+
+    static void reconnect_worker_callback(async_context_t *context, async_at_time_worker_t *worker) {
+        sio_client *self = (sio_client*)worker->user_data;
+        alarms_fired = 0;
+        watchdog_update();
+        debug1("Setting up alarm to extend watchdog to 30 seconds\n");
+        self->watchdog_extender = add_alarm_in_us(7333333ull, alarm_callback, NULL, false);
+        self->reconnect();
+    }
+
+    static void work_worker_callback(async_context_t *context, async_when_pending_worker_t *worker) {
+        sio_client *self = (sio_client*)worker->user_data;
+        std::vector<std::function<void()>> work;
+        work.swap(self->posted);
+        for(std::function<void()> &item : work) {
+            item();
+        }
+    }
+
+    // A binary packet waiting for its attachments. Frames don't outlive the binary callback,
+    // so all but the last attachment are copied into held; the last is passed in place.
+    struct binary_packet {
+        std::string ns;
+        nlohmann::json array;
+        uint32_t expected = 0, received = 0;
+        // Set for an event that asks for an ack, and for every binary ack
+        std::optional<uint32_t> id;
+        bool ack = false;
+        // Dropped packets still swallow their attachments
+        bool drop = false;
+        std::vector<uint8_t> held;
+        std::array<size_t, SIO_MAX_ATTACHMENTS> held_ends{};
+    };
+    binary_packet binary;
+
+    void reset_binary() {
+        binary.ns.clear();
+        binary.array = nullptr;
+        binary.expected = binary.received = 0;
+        binary.id.reset();
+        binary.ack = false;
+        binary.drop = false;
+        // Keeps the capacity for the next packet
+        binary.held.clear();
+    }
+
+    // Hands the packet to its socket, first and second being its last attachment
+    void deliver_binary(std::span<const uint8_t> first, std::span<const uint8_t> second) {
+        if(!binary.drop && namespace_connections.find(binary.ns) != namespace_connections.end()) {
+            std::array<sio_attachment, SIO_MAX_ATTACHMENTS> attachments;
+            size_t start = 0;
+            for(uint32_t i = 0; i < binary.received; i++) {
+                attachments[i].first = std::span<const uint8_t>(binary.held).subspan(start, binary.held_ends[i] - start);
+                start = binary.held_ends[i];
+            }
+            if(binary.expected > 0) {
+                attachments[binary.expected - 1] = {first, second};
+            }
+            std::span<const sio_attachment> received = std::span(attachments).first(binary.expected);
+            if(binary.ack) {
+                namespace_connections[binary.ns]->binary_ack_received(*binary.id, std::move(binary.array), received);
+            } else {
+                namespace_connections[binary.ns]->binary_event_callback(std::move(binary.array), received, binary.id);
+            }
+        }
+        reset_binary();
+    }
+
+    void engine_binary_callback(std::span<const uint8_t> first, std::span<const uint8_t> second) {
+        if(binary.expected == 0) {
+            error("sio_client: unexpected binary message of %u bytes, dropping\n", first.size() + second.size());
+            return;
+        }
+        if(binary.received + 1 == binary.expected) {
+            deliver_binary(first, second);
+            return;
+        }
+        if(!binary.drop) {
+            binary.held.insert(binary.held.end(), first.begin(), first.end());
+            binary.held.insert(binary.held.end(), second.begin(), second.end());
+            binary.held_ends[binary.received] = binary.held.size();
+        }
+        binary.received++;
+    }
+
+    void init(const std::map<std::string, std::string> &query) {
+        if(!url.valid()) {
+            error("sio_client: invalid URL (status %d)\n", (int)url.status);
+        }
+        http = new http_client(url);
+        query_string = "?EIO=4";
+        for(std::map<std::string, std::string>::const_iterator iter = query.cbegin(); iter != query.cend(); iter++) {
+            query_string += "&" + iter->first + "=" + iter->second;
+        }
+        http->on_response(std::bind(&sio_client::http_response_callback, this));
+        async_context_add_when_pending_worker(cyw43_arch_async_context(), &work_worker);
+    }
 
     void http_response_callback() {
         info("Got http response: %d %s\n", http->response().status(), http->response().get_status_text().c_str());
         
         if(http->response().status() == 101) {
             trace1("sio_client: creating engine\n");
-            engine = new eio_client(http->release_tcp_client());
+            ws::deflate_options deflate = http->negotiated_deflate();
+            eio_client *websocket_engine = new eio_client(http->release_tcp_client(), deflate);
             delete http;
             http = nullptr;
-            trace1("sio_client: engine created\n");
-            if(!engine) {
-                error1("Engine is nullptr\n");
-                return;
+            attach_engine(websocket_engine);
+        } else if(websocket_unavailable(http->response().status())) {
+            info1("sio_client: websocket upgrade refused, falling back to polling\n");
+            transport = transport_type::polling;
+            schedule_reconnect(1000);
+        } else {
+            error("sio_client: websocket upgrade failed with %d, retrying\n", http->response().status());
+            schedule_reconnect(1000);
+        }
+    }
+
+    // Answers meaning the server, or a proxy on the way, doesn't do websocket: Engine.IO's
+    // 400 for an unknown transport, 426, or a plain 2xx that ignored the Upgrade header.
+    // Anything else (5xx, 429, ...) may well be gone on the next attempt.
+    static bool websocket_unavailable(int status) {
+        return status == 400 || status == 426 || (status >= 200 && status < 300);
+    }
+
+    void attach_engine(eio_client *new_engine) {
+        engine = new_engine;
+        trace1("sio_client: engine created\n");
+        engine->on_open([this](){
+            open_ = true;
+            if(this->watchdog_extender) {
+                debug1("Cancelling watchdog extension\n");
+                cancel_alarm(this->watchdog_extender);
+                this->watchdog_extender = 0;
+            } else {
+                debug1("Watchdog extension timer id not set?\n");
             }
-            engine->on_open([this](){
-                open_ = true;
-                if(this->watchdog_extender) {
-                    debug1("Cancelling watchdog extension\n");
-                    cancel_alarm(this->watchdog_extender);
-                    this->watchdog_extender = 0;
-                } else {
-                    debug1("Watchdog extension timer id not set?\n");
-                }
-                user_open_callback();
-            });
-            trace1("sio_client: set engine open\n");
-            engine->on_receive(std::bind(&sio_client::engine_recv_callback, this));
-            engine->on_closed(std::bind(&sio_client::engine_closed_callback, this, std::placeholders::_1));
-            trace1("sio_client: set engine recv\n");
-            for(auto iter = namespace_connections.begin(); iter != namespace_connections.end(); iter++) {
-                iter->second->update_engine(engine);
+            user_open_callback();
+        });
+        trace1("sio_client: set engine open\n");
+        engine->on_receive(std::bind(&sio_client::engine_recv_callback, this));
+        engine->on_binary(std::bind(&sio_client::engine_binary_callback, this, std::placeholders::_1, std::placeholders::_2));
+        engine->on_closed(std::bind(&sio_client::engine_closed_callback, this, std::placeholders::_1));
+        trace1("sio_client: set engine recv\n");
+        for(auto iter = namespace_connections.begin(); iter != namespace_connections.end(); iter++) {
+            iter->second->update_engine(engine);
+        }
+        engine->read_initial_packet();
+    }
+
+    // Splits [/namespace,][id][...] starting at pos: id is set if there is one, array_start is
+    // where the arguments begin. False if no array follows right after.
+    static bool split_packet(std::string_view data, size_t pos, std::optional<uint32_t> &id, size_t &array_start) {
+        if(pos < data.size() && data[pos] == '/') {
+            pos = data.find(',', pos);
+            if(pos == std::string_view::npos) {
+                return false;
             }
-            engine->read_initial_packet();
+            pos++;
         }
+        uint32_t value = 0;
+        auto [id_end, ec] = std::from_chars(data.data() + pos, data.data() + data.size(), value);
+        if(ec == std::errc()) {
+            id = value;
+            pos = id_end - data.data();
+        }
+        if(pos >= data.size() || data[pos] != '[') {
+            return false;
+        }
+        array_start = pos;
+        return true;
     }
 
     void engine_recv_callback() {
         debug1("sio_client::engine_recv_callback\n");
-        std::string data;
+        // Reuses the capacity of earlier packets
+        std::string &data = packet;
         data.resize(engine->packet_size());
         engine->read({(uint8_t*)data.data(), data.size()});
         debug("read data: '%s'\n", data.c_str());
@@ -325,6 +915,11 @@ private:
 
         debug("Packet type: %c\n", data[0]);
 
+        if(binary.expected > 0) {
+            error("sio_client: binary packet got %u of %u attachments, dropping it\n", binary.received, binary.expected);
+            reset_binary();
+        }
+
         switch((packet_type)data[0]) {
         case packet_type::connect:{
             if((tok_start = data.find("{")) != std::string::npos) {
@@ -349,16 +944,72 @@ private:
             }
             break;
 
-        case packet_type::event:
-            if((tok_start = data.find_first_of("[")) != std::string::npos) {
-                tok_end = data.find_last_of("]");
-                body = nlohmann::json::parse(data.substr(tok_start, (tok_end + 1) - tok_start));
+        case packet_type::ack:{
+            // 3[/namespace,]<id>[args...]
+            std::optional<uint32_t> id;
+            if(!split_packet(data, 1, id, tok_start) || !id) {
+                error("sio_client: malformed ack packet '%s'\n", data.c_str());
+                break;
+            }
+            nlohmann::json args = nlohmann::json::parse(std::string_view(data).substr(tok_start), nullptr, false);
+            if(args.is_discarded()) {
+                error1("sio_client: invalid ack JSON\n");
+                break;
             }
             if(namespace_connections.find(ns) != namespace_connections.end()) {
-                namespace_connections[ns]->event_callback(body);
+                namespace_connections[ns]->ack_received(*id, std::move(args));
             }
             break;
         }
+
+        case packet_type::event:{
+            // 2[/namespace,][id][args...]
+            std::optional<uint32_t> id;
+            tok_end = data.find_last_of("]");
+            if(!split_packet(data, 1, id, tok_start) || tok_end == std::string::npos || tok_end < tok_start) {
+                error1("sio_client: event packet without an array\n");
+                break;
+            }
+            if(namespace_connections.find(ns) != namespace_connections.end()) {
+                namespace_connections[ns]->dispatch(std::string_view(data).substr(tok_start, (tok_end + 1) - tok_start), id);
+            }
+            break;
+        }
+
+        case packet_type::binary_event:
+        case packet_type::binary_ack:{
+            // 5<attachments>-[/namespace,][id][args...] or 6<attachments>-[/namespace,]<id>[args...],
+            // followed by one binary message per attachment
+            uint32_t count = 0;
+            auto [count_end, ec] = std::from_chars(data.data() + 1, data.data() + data.size(), count);
+            bool ack = (packet_type)data[0] == packet_type::binary_ack;
+            std::optional<uint32_t> id;
+            tok_end = data.find_last_of(']');
+            if(ec != std::errc() || count_end == data.data() + data.size() || *count_end != '-'
+                || !split_packet(data, count_end + 1 - data.data(), id, tok_start) || tok_end == std::string::npos || tok_end < tok_start || (ack && !id)) {
+                error("sio_client: malformed binary packet '%s'\n", data.c_str());
+                break;
+            }
+            binary.ns = ns;
+            binary.expected = count;
+            binary.id = id;
+            binary.ack = ack;
+            if(count > SIO_MAX_ATTACHMENTS) {
+                error("sio_client: binary %s with %u attachments is over SIO_MAX_ATTACHMENTS, dropping it\n", ack ? "ack" : "event", count);
+                binary.drop = true;
+            } else {
+                binary.array = nlohmann::json::parse(std::string_view(data).substr(tok_start, (tok_end + 1) - tok_start), nullptr, false);
+                if(binary.array.is_discarded()) {
+                    error1("sio_client: invalid binary packet JSON\n");
+                    binary.drop = true;
+                }
+            }
+            if(count == 0) {
+                deliver_binary({}, {});
+            }
+            break;
+        }
+        }
     }
 
     void engine_closed_callback(err_t reason) {
@@ -374,13 +1025,13 @@ private:
             iter->second->sid_ = "";
             iter->second->disconnect_callback(disconnect_reason);
         }
+        reset_binary();
         delete engine;
         engine = nullptr;
         for(auto iter = namespace_connections.begin(); iter != namespace_connections.end(); iter++) {
             iter->second->update_engine(engine);
         }
 
-        reconnect_time = make_timeout_time_ms(1000);
-        debug("Scheduled reconnect for time %lld\n", reconnect_time);
+        schedule_reconnect(1000);
     }
 };
\ No newline at end of file
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#include "nlohmann/json.hpp"
+
+#include "logger.h"
+
+// mallinfo walks the whole heap, so heap accounting is only compiled in where it is reported
+#if defined(PICO_BENCHMARKS) || LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define SIO_HEAP_STATS 1
+#include <malloc.h>
+#else
+#define SIO_HEAP_STATS 0
+#endif
+
+// Bytes currently allocated from the heap, 0 without SIO_HEAP_STATS
+inline size_t heap_in_use() {
+#if SIO_HEAP_STATS && defined(__GLIBC__)
+    return mallinfo2().uordblks;
+#elif SIO_HEAP_STATS
+    return mallinfo().uordblks;
+#else
+    return 0;
+#endif
+}
+
+// Receives the arguments of an event as SAX events instead of a DOM. Every callback
+// defaults to accepting and ignoring its value, returning false stops the parse.
+class sio_event_handler : public nlohmann::json_sax<nlohmann::json> {
+public:
+    using json = nlohmann::json;
+
+    // Called before the first argument of each event
+    virtual void begin() {}
+    // Called after the last argument, ok is false if the parse failed or was stopped
+    virtual void end(bool ok) {}
+
+    bool null() override { return true; }
+    bool boolean(bool value) override { return true; }
+    bool number_integer(json::number_integer_t value) override { return true; }
+    bool number_unsigned(json::number_unsigned_t value) override { return true; }
+    bool number_float(json::number_float_t value, const json::string_t &text) override { return true; }
+    bool string(json::string_t &value) override { return true; }
+    bool binary(json::binary_t &value) override { return true; }
+    bool start_object(std::size_t elements) override { return true; }
+    bool key(json::string_t &value) override { return true; }
+    bool end_object() override { return true; }
+    bool start_array(std::size_t elements) override { return true; }
+    bool end_array() override { return true; }
+    bool parse_error(std::size_t position, const std::string &last_token, const nlohmann::detail::exception &ex) override {
+        error("sio_event_handler parse error at %u: %s\n", position, ex.what());
+        return false;
+    }
+};
+
+// Parses an event array ["name", args...] straight from the packet and hands everything
+// but the outer array and the name to a sio_event_handler
+class sio_event_sax : public nlohmann::json_sax<nlohmann::json> {
+public:
+    using json = nlohmann::json;
+
+    sio_event_sax(sio_event_handler *handler): handler(handler) {}
+
+    // Most heap in use while parsing, sampled whenever an object or array closes. Always 0
+    // without SIO_HEAP_STATS.
+    size_t peak_heap() const {
+        return peak_heap_;
+    }
+
+    // The name of the event in a packet's array, empty if it isn't a plain string
+    static std::string_view event_name(std::string_view array) {
+        size_t start = array.find_first_not_of(" \t\r\n", 1);
+        if(array.empty() || array[0] != '[' || start == std::string_view::npos || array[start] != '"') {
+            return {};
+        }
+        size_t end = array.find_first_of("\"\\", start + 1);
+        if(end == std::string_view::npos || array[end] != '"') {
+            return {};
+        }
+        return array.substr(start + 1, end - start - 1);
+    }
+
+    bool parse(std::string_view array) {
+        depth = 0;
+        named = false;
+        if constexpr(SIO_HEAP_STATS) {
+            peak_heap_ = heap_in_use();
+        }
+        handler->begin();
+        bool ok = json::sax_parse(array, this);
+        handler->end(ok);
+        return ok;
+    }
+
+    bool null() override { return forward() && handler->null(); }
+    bool boolean(bool value) override { return forward() && handler->boolean(value); }
+    bool number_integer(json::number_integer_t value) override { return forward() && handler->number_integer(value); }
+    bool number_unsigned(json::number_unsigned_t value) override { return forward() && handler->number_unsigned(value); }
+    bool number_float(json::number_float_t value, const json::string_t &text) override { return forward() && handler->number_float(value, text); }
+    bool binary(json::binary_t &value) override { return forward() && handler->binary(value); }
+    bool key(json::string_t &value) override { return handler->key(value); }
+
+    bool string(json::string_t &value) override {
+        if(depth == 1 && !named) {
+            named = true;
+            return true;
+        }
+        return forward() && handler->string(value);
+    }
+
+    bool start_object(std::size_t elements) override {
+        if(!forward()) {
+            return false;
+        }
+        depth++;
+        return handler->start_object(elements);
+    }
+
+    bool end_object() override {
+        depth--;
+        sample_heap();
+        return handler->end_object();
+    }
+
+    bool start_array(std::size_t elements) override {
+        if(depth++ == 0) {
+            return true;
+        }
+        return forward() && handler->start_array(elements);
+    }
+
+    bool end_array() override {
+        sample_heap();
+        if(--depth == 0) {
+            return true;
+        }
+        return handler->end_array();
+    }
+
+    bool parse_error(std::size_t position, const std::string &last_token, const nlohmann::detail::exception &ex) override {
+        return handler->parse_error(position, last_token, ex);
+    }
+
+private:
+    sio_event_handler *handler;
+    int depth = 0;
+    bool named = false;
+    size_t peak_heap_ = 0;
+
+    // Values are only arguments inside the outer array and after the name
+    bool forward() const {
+        return depth > 0 && named;
+    }
+
+    void sample_heap() {
+        if constexpr(SIO_HEAP_STATS) {
+            peak_heap_ = std::max(peak_heap_, heap_in_use());
+        }
+    }
+};
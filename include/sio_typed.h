@@ -0,0 +1,233 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+
+#include "sio_sax.h"
+
+// Where a field lives in an event's arguments: '/' separated object keys and array
+// indices, starting with the index of the argument. "0/devices/0/lastData/tempf" is
+// args[0]["devices"][0]["lastData"]["tempf"]. Split at compile time.
+struct json_path {
+    static constexpr size_t max_depth = 8;
+
+    std::array<std::string_view, max_depth> segments{};
+    uint8_t depth = 0;
+
+    consteval json_path(const char *path) {
+        std::string_view rest = path;
+        while(true) {
+            size_t slash = rest.find('/');
+            std::string_view segment = rest.substr(0, slash);
+            if(segment.empty() || depth == max_depth) {
+                throw "json_path segments must be non-empty and at most json_path::max_depth deep";
+            }
+            segments[depth++] = segment;
+            if(slash == std::string_view::npos) {
+                break;
+            }
+            rest.remove_prefix(slash + 1);
+        }
+    }
+
+    // True if the segment at level is the array index
+    constexpr bool is_index(size_t level, size_t index) const {
+        std::string_view segment = segments[level];
+        size_t value = 0;
+        for(char c : segment) {
+            if(c < '0' || c > '9') {
+                return false;
+            }
+            value = value * 10 + (c - '0');
+        }
+        return value == index;
+    }
+};
+
+template <typename T, typename M>
+struct json_field {
+    json_path path;
+    M T::*member;
+};
+
+// Specialize with a constexpr tuple of json_fields to make T usable with sio_socket::on<T>:
+//
+//     template <> struct json_binding<sample> {
+//         static constexpr std::tuple fields{json_field{"0/tempf", &sample::tempf}};
+//     };
+template <typename T>
+struct json_binding;
+
+// Fills a T from a single pass over the event, values that are not bound are skipped
+// without being stored. Fields that are missing or have the wrong type keep the value
+// of a default constructed T.
+template <typename T>
+class sio_typed_handler : public sio_event_handler {
+public:
+    sio_typed_handler(std::function<void(const T&)> callback): callback(callback) {}
+
+    void begin() override {
+        value = T{};
+        level = 0;
+        overflow = 0;
+        levels[0] = {false, 0, 0};
+        matched.fill(0);
+    }
+
+    void end(bool ok) override {
+        if(ok) {
+            callback(value);
+        }
+    }
+
+    bool null() override {
+        next_value();
+        return true;
+    }
+    bool boolean(bool v) override { return scalar(v); }
+    bool number_integer(json::number_integer_t v) override { return scalar(v); }
+    bool number_unsigned(json::number_unsigned_t v) override { return scalar(v); }
+    bool number_float(json::number_float_t v, const json::string_t &text) override { return scalar(v); }
+    bool string(json::string_t &v) override { return scalar(v); }
+
+    bool key(json::string_t &key) override {
+        uint32_t mask = 0;
+        for_each_field([&](size_t index, const auto &field) {
+            if(matched[index] == level && field.path.segments[level] == key) {
+                mask |= 1u << index;
+            }
+        });
+        levels[level].key_mask = mask;
+        return true;
+    }
+
+    bool start_object(std::size_t elements) override {
+        return enter(true);
+    }
+
+    bool end_object() override {
+        return leave();
+    }
+
+    bool start_array(std::size_t elements) override {
+        return enter(false);
+    }
+
+    bool end_array() override {
+        return leave();
+    }
+
+private:
+    using fields_type = std::remove_cvref_t<decltype(json_binding<T>::fields)>;
+    static constexpr size_t field_count = std::tuple_size_v<fields_type>;
+    static_assert(field_count <= 32, "at most 32 fields can be bound");
+
+    struct level_state {
+        bool object;
+        uint32_t key_mask;
+        size_t index;
+    };
+
+    std::function<void(const T&)> callback;
+    T value{};
+    // Level 0 is the argument list, which behaves like an array
+    std::array<level_state, json_path::max_depth + 1> levels{};
+    size_t level = 0;
+    // Containers entered below json_path::max_depth
+    size_t overflow = 0;
+    // How many leading segments of each field's path the current position is inside of
+    std::array<uint8_t, field_count> matched{};
+
+    template <typename F>
+    static void for_each_field(F &&function) {
+        [&]<size_t... I>(std::index_sequence<I...>) {
+            (function(I, std::get<I>(json_binding<T>::fields)), ...);
+        }(std::make_index_sequence<field_count>{});
+    }
+
+    // Fields whose path continues with the value that is arriving at the current level
+    uint32_t candidates() const {
+        if(levels[level].object) {
+            return levels[level].key_mask;
+        }
+        uint32_t mask = 0;
+        for_each_field([&](size_t index, const auto &field) {
+            if(matched[index] == level && field.path.is_index(level, levels[level].index)) {
+                mask |= 1u << index;
+            }
+        });
+        return mask;
+    }
+
+    void next_value() {
+        levels[level].key_mask = 0;
+        levels[level].index++;
+    }
+
+    template <typename V>
+    bool scalar(V &v) {
+        uint32_t mask = candidates();
+        if(mask != 0) {
+            for_each_field([&](size_t index, const auto &field) {
+                if((mask & (1u << index)) && field.path.depth == level + 1) {
+                    assign(value.*field.member, v);
+                }
+            });
+        }
+        next_value();
+        return true;
+    }
+
+    template <typename M, typename V>
+    static void assign(M &member, V &v) {
+        if constexpr(std::is_same_v<M, bool> || std::is_same_v<V, bool>) {
+            if constexpr(std::is_same_v<M, V>) {
+                member = v;
+            }
+        } else if constexpr(std::is_arithmetic_v<M> && std::is_arithmetic_v<V>) {
+            member = static_cast<M>(v);
+        } else if constexpr(std::is_assignable_v<M&, const V&>) {
+            member = v;
+        }
+    }
+
+    bool enter(bool object) {
+        uint32_t mask = candidates();
+        bool inside = false;
+        for_each_field([&](size_t index, const auto &field) {
+            if((mask & (1u << index)) && field.path.depth > level + 1) {
+                matched[index] = level + 1;
+                inside = true;
+            }
+        });
+        if(level == json_path::max_depth) {
+            // Deeper than any path, just has to be balanced
+            if(inside) {
+                return false;
+            }
+            overflow++;
+            return true;
+        }
+        level++;
+        levels[level] = {object, 0, 0};
+        return true;
+    }
+
+    bool leave() {
+        if(overflow > 0) {
+            overflow--;
+            return true;
+        }
+        level--;
+        for(uint8_t &depth : matched) {
+            depth = std::min<uint8_t>(depth, level);
+        }
+        next_value();
+        return true;
+    }
+};
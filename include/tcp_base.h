@@ -3,6 +3,7 @@
 #include <string>
 #include <functional>
 #include <span>
+#include <array>
 #include <cstdint>
 
 #include "lwip/err.h"
@@ -13,10 +14,18 @@
 
 class tcp_base {
 public:
+    virtual ~tcp_base() = default;
+
     virtual bool init() = 0;
     virtual int available() const = 0;
     virtual size_t read(std::span<uint8_t> out) = 0;
+    // Up to count received bytes in place, split in two where the buffer wraps. They stay
+    // valid until the next read() or skip(), which consumes them.
+    virtual std::array<std::span<const uint8_t>, 2> peek(size_t count) const = 0;
+    virtual size_t skip(size_t count) = 0;
     virtual bool write(std::span<const uint8_t> data) = 0;
+    // Bytes write() can queue right now
+    virtual size_t sndbuf() const = 0;
     virtual bool connect(std::string host, uint16_t port) = 0;
     virtual err_t close(err_t reason) = 0;
 
@@ -26,5 +35,7 @@ public:
     virtual void on_receive(std::function<void()> callback) = 0;
     virtual void on_connected(std::function<void()> callback) = 0;
     virtual void on_poll(uint8_t interval_seconds, std::function<void()> callback) = 0;
+    // Called with the number of bytes the remote acknowledged, i.e. how much sndbuf() grew
+    virtual void on_sent(std::function<void(uint16_t)> callback) = 0;
     virtual void on_closed(std::function<void(err_t)> callback) = 0;
 };
\ No newline at end of file
@@ -16,7 +16,10 @@ public:
     bool init() override;
     int available() const  override;
     size_t read(std::span<uint8_t> out) override;
+    std::array<std::span<const uint8_t>, 2> peek(size_t count) const override;
+    size_t skip(size_t count) override;
     bool write(std::span<const uint8_t> data) override;
+    size_t sndbuf() const override;
     bool connect(ip_addr_t addr, uint16_t port);
     bool connect(std::string addr, uint16_t port) override;
     err_t close(err_t reason) override;
@@ -34,6 +37,10 @@ public:
 
     void on_poll(uint8_t interval_seconds, std::function<void()> callback);
 
+    void on_sent(std::function<void(uint16_t)> callback) override {
+        user_sent_callback = callback;
+    }
+
     void on_closed(std::function<void(err_t)> callback) override {
         user_closed_callback = callback;
     }
@@ -42,14 +49,18 @@ protected:
     struct tcp_pcb *tcp_controlblock;
     ip_addr_t remote_addr;
     circular_buffer<uint8_t> buffer{BUF_SIZE};
+    // Received data that did not fit in the buffer yet
+    pbuf *pending = nullptr;
     int buffer_len;
     int sent_len;
     bool connected_, initialized_;
     uint16_t port_;
     std::function<void()> user_receive_callback, user_connected_callback, user_poll_callback;
     std::function<void(err_t)> user_closed_callback;
+    std::function<void(uint16_t)> user_sent_callback;
 
     bool connect();
+    void drain_pending();
 
     static void dns_callback(const char* name, const ip_addr_t *addr, void* arg);
     static err_t poll_callback(void* arg, tcp_pcb* pcb);
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <string_view>
+#include <cstdint>
+
+#include <pico/time.h>
+#include <pico/async_context.h>
+
+#include "lwip/opt.h"
+
+#include "tcp_base.h"
+
+// Keep one pcb free for the websocket connection and one for a request that is being set up
+#ifndef TCP_POOL_SIZE
+#define TCP_POOL_SIZE (MEMP_NUM_TCP_PCB - 2)
+#endif
+
+#ifndef TCP_POOL_IDLE_TIMEOUT_MS
+#define TCP_POOL_IDLE_TIMEOUT_MS 30000
+#endif
+
+static_assert(TCP_POOL_SIZE > 0, "MEMP_NUM_TCP_PCB is too small to pool any connections");
+static_assert(TCP_POOL_SIZE <= MEMP_NUM_TCP_PCB - 1, "TCP_POOL_SIZE must leave a pcb for the active connection");
+
+// Hands out idle, already connected transports keyed by scheme/host/port.
+// "http"/"ws" and "https"/"wss" share a key since they use the same transport.
+// A timer closes idle connections once they time out, so an idle TLS session doesn't
+// hold its pcb and mbedtls heap until the next request.
+class tcp_pool {
+public:
+    static tcp_pool &instance();
+
+    // Returns a healthy idle connection for the key if there is one, otherwise a new unconnected client
+    tcp_base *acquire(std::string_view scheme, std::string_view host, uint16_t port);
+
+    // Returns a connection to the pool. Connections that are closed or have unread data are destroyed instead.
+    void release(std::string_view scheme, std::string_view host, uint16_t port, tcp_base *tcp);
+
+    // Closes every connection that has been idle for TCP_POOL_IDLE_TIMEOUT_MS. Runs from a
+    // timer as well as from acquire and release.
+    void evict_idle();
+
+    size_t idle_count() const;
+
+private:
+    struct entry {
+        tcp_base *tcp = nullptr;
+        bool secure = false;
+        std::string host;
+        uint16_t port = 0;
+        absolute_time_t idle_since = nil_time;
+    };
+
+    std::array<entry, TCP_POOL_SIZE> entries;
+    // Fires when the connection that has been idle the longest times out
+    async_at_time_worker_t evict_timer{.do_work = evict_timer_callback, .user_data = this};
+
+    tcp_pool() = default;
+
+    void arm_evict_timer();
+    static void evict_timer_callback(async_context_t *context, async_at_time_worker_t *worker);
+
+    static bool is_secure(std::string_view scheme);
+    static bool healthy(const tcp_base *tcp);
+    static void destroy(tcp_base *tcp);
+    void evict(entry &slot);
+};
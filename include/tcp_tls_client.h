@@ -15,7 +15,10 @@ public:
     bool init() override;
     int available() const override;
     size_t read(std::span<uint8_t> out) override;
+    std::array<std::span<const uint8_t>, 2> peek(size_t count) const override;
+    size_t skip(size_t count) override;
     bool write(std::span<const uint8_t> data) override;
+    size_t sndbuf() const override;
     bool connect(std::string host, uint16_t port) override;
     err_t close(err_t reason) override;
 
@@ -35,6 +38,10 @@ public:
         user_poll_callback = callback;
     }
 
+    void on_sent(std::function<void(uint16_t)> callback) override {
+        user_sent_callback = callback;
+    }
+
     void on_closed(std::function<void(err_t)> callback) override {
         user_closed_callback = callback;
     }
@@ -43,14 +50,18 @@ private:
     altcp_pcb *tcp_controlblock;
     ip_addr_t remote_addr;
     circular_buffer<uint8_t> buffer{BUF_SIZE};
+    // Received data that did not fit in the buffer yet
+    pbuf *pending = nullptr;
     int buffer_len;
     int sent_len;
     bool connected_, initialized_;
     uint16_t port_;
     std::function<void()> user_receive_callback, user_connected_callback, user_poll_callback;
     std::function<void(err_t)> user_closed_callback;
+    std::function<void(uint16_t)> user_sent_callback;
 
     bool connect();
+    void drain_pending();
     static void dns_callback(const char* name, const ip_addr_t *addr, void* arg);
     static err_t connected_callback(void* arg, altcp_pcb* pcb, err_t err);
     static err_t recv_callback(void* arg, altcp_pcb* pcb, pbuf* p, err_t err);
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string_view>
+
+// Splits a URL (RFC 3986 "scheme://[user[:password]@]host[:port][/path][?query][#fragment]")
+// into views of the caller's string without allocating. Everything is constexpr, so URL
+// literals are validated and split at compile time:
+//
+//     using namespace url_literals;
+//     constexpr url_view url = "https://rt2.ambientweather.net/"_url;
+//
+// The views are only valid as long as the parsed string is.
+struct url_view {
+    enum class status_code : uint8_t {
+        ok,
+        no_scheme,
+        invalid_scheme,
+        no_double_slash,
+        empty_host,
+        invalid_host,
+        invalid_port
+    };
+
+    status_code status = status_code::no_scheme;
+    std::string_view scheme, user_name, password, host, port_string, path, query, fragment;
+    // The explicit port, or the default port of the scheme (0 if unknown)
+    uint16_t port = 0;
+
+    constexpr bool valid() const {
+        return status == status_code::ok;
+    }
+
+    constexpr bool secure() const {
+        return secure_scheme(scheme);
+    }
+
+    // The path as a request line needs it, "/" if the URL has none
+    constexpr std::string_view path_or_root() const {
+        return path.empty() ? "/" : path;
+    }
+
+    // Path and query as they are in the URL. Without a path this is only the query with its
+    // '?' (e.g. "?EIO=4" for "https://host?EIO=4"), or empty, and a request line has to put
+    // a "/" in front of it.
+    constexpr std::string_view target() const {
+        if(query.empty()) {
+            return path;
+        }
+        // The query view starts right after its '?'
+        const char *start = path.empty() ? query.data() - 1 : path.data();
+        return {start, (size_t)(query.data() + query.size() - start)};
+    }
+
+    // Schemes are case-insensitive (RFC 3986 3.1)
+    static constexpr bool scheme_equals(std::string_view scheme, std::string_view lower) {
+        return std::equal(scheme.begin(), scheme.end(), lower.begin(), lower.end(), [](char a, char b) {
+            return (a >= 'A' && a <= 'Z' ? a - 'A' + 'a' : a) == b;
+        });
+    }
+
+    static constexpr bool secure_scheme(std::string_view scheme) {
+        return scheme_equals(scheme, "https") || scheme_equals(scheme, "wss");
+    }
+
+    static constexpr uint16_t default_port(std::string_view scheme) {
+        if(scheme_equals(scheme, "http") || scheme_equals(scheme, "ws")) {
+            return 80;
+        }
+        if(secure_scheme(scheme)) {
+            return 443;
+        }
+        return 0;
+    }
+
+    static constexpr url_view parse(std::string_view url) {
+        url_view result;
+
+        size_t colon = url.find(':');
+        if(colon == std::string_view::npos || colon == 0) {
+            return result;
+        }
+        result.scheme = url.substr(0, colon);
+        for(size_t i = 0; i < result.scheme.size(); i++) {
+            char c = result.scheme[i];
+            bool alpha = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+            bool other = (c >= '0' && c <= '9') || c == '+' || c == '-' || c == '.';
+            if(!alpha && (i == 0 || !other)) {
+                return result.fail(status_code::invalid_scheme);
+            }
+        }
+        url.remove_prefix(colon + 1);
+        if(!url.starts_with("//")) {
+            return result.fail(status_code::no_double_slash);
+        }
+        url.remove_prefix(2);
+
+        std::string_view authority = url.substr(0, std::min(url.find_first_of("/?#"), url.size()));
+        url.remove_prefix(authority.size());
+
+        size_t at = authority.rfind('@');
+        if(at != std::string_view::npos) {
+            std::string_view user_info = authority.substr(0, at);
+            size_t separator = user_info.find(':');
+            result.user_name = user_info.substr(0, separator);
+            if(separator != std::string_view::npos) {
+                result.password = user_info.substr(separator + 1);
+            }
+            authority.remove_prefix(at + 1);
+        }
+
+        // IPv6 literals keep their brackets so the host can be passed on unchanged
+        size_t host_end = 0;
+        if(authority.starts_with('[')) {
+            host_end = authority.find(']');
+            if(host_end == std::string_view::npos) {
+                return result.fail(status_code::invalid_host);
+            }
+            host_end++;
+        } else {
+            host_end = std::min(authority.find(':'), authority.size());
+        }
+        result.host = authority.substr(0, host_end);
+        if(result.host.empty()) {
+            return result.fail(status_code::empty_host);
+        }
+        authority.remove_prefix(host_end);
+
+        result.port = default_port(result.scheme);
+        if(authority.starts_with(':')) {
+            result.port_string = authority.substr(1);
+            if(result.port_string.size() > 0) {
+                uint32_t port = 0;
+                for(char c : result.port_string) {
+                    if(c < '0' || c > '9') {
+                        return result.fail(status_code::invalid_port);
+                    }
+                    port = port * 10 + (c - '0');
+                    if(port > 65535) {
+                        return result.fail(status_code::invalid_port);
+                    }
+                }
+                if(port == 0) {
+                    return result.fail(status_code::invalid_port);
+                }
+                result.port = port;
+            }
+        } else if(!authority.empty()) {
+            return result.fail(status_code::invalid_host);
+        }
+
+        size_t fragment_start = url.find('#');
+        if(fragment_start != std::string_view::npos) {
+            result.fragment = url.substr(fragment_start + 1);
+            url = url.substr(0, fragment_start);
+        }
+        size_t query_start = url.find('?');
+        if(query_start != std::string_view::npos) {
+            result.query = url.substr(query_start + 1);
+            url = url.substr(0, query_start);
+        }
+        result.path = url;
+
+        result.status = status_code::ok;
+        return result;
+    }
+
+private:
+    constexpr url_view fail(status_code code) const {
+        url_view result = *this;
+        result.status = code;
+        return result;
+    }
+};
+
+namespace url_literals {
+    // Fails to compile when the literal is not a valid URL
+    consteval url_view operator""_url(const char *url, size_t length) {
+        url_view result = url_view::parse({url, length});
+        if(!result.valid()) {
+            throw "invalid URL literal";
+        }
+        return result;
+    }
+}
+
+namespace url_literals {
+    // Edge cases, checked whenever this header is compiled
+    static_assert("https://rt2.ambientweather.net/"_url.port == 443);
+    static_assert("https://host?EIO=4"_url.path_or_root() == "/");
+    static_assert("https://host?EIO=4"_url.target() == "?EIO=4");
+    static_assert("https://host/socket.io/?EIO=4#x"_url.target() == "/socket.io/?EIO=4");
+    static_assert("https://host"_url.target().empty());
+    static_assert("HTTPS://host"_url.port == 443 && "HTTPS://host"_url.secure());
+    static_assert("Ws://host"_url.port == 80 && !"Ws://host"_url.secure());
+    static_assert("http://[::1]:8000/"_url.host == "[::1]" && "http://[::1]:8000/"_url.port == 8000);
+    static_assert("http://user:pw@host/"_url.password == "pw");
+    static_assert(url_view::parse("http://host:0/").status == url_view::status_code::invalid_port);
+    static_assert(url_view::parse("http://host:65536/").status == url_view::status_code::invalid_port);
+    static_assert(url_view::parse("http:/host").status == url_view::status_code::no_double_slash);
+    static_assert(url_view::parse("1http://host").status == url_view::status_code::invalid_scheme);
+    static_assert(url_view::parse("http://:80").status == url_view::status_code::empty_host);
+}
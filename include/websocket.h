@@ -3,21 +3,58 @@
 #include <cstddef>
 #include <cstdint>
 #include <vector>
+#include <deque>
+#include <array>
 #include <cstring>
 #include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <initializer_list>
+
+#include <pico/time.h>
 
 #include "circular_buffer.h"
 #include "tcp_base.h"
+#include "inflate.h"
+#include "ws_mask.h"
 #include "logger.h"
-class eio_client;
 
-extern "C" {
-    int mbedtls_hardware_poll(void *data, unsigned char *output, size_t len, size_t *olen);
-}
+// Window requested from the server for permessage-deflate (RFC 7692 allows 8 to 15)
+#ifndef WS_DEFLATE_WINDOW_BITS
+#define WS_DEFLATE_WINDOW_BITS 11
+#endif
+
+// Larger messages close the connection with 1009 (message too big)
+#ifndef WS_MAX_MESSAGE_SIZE
+#define WS_MAX_MESSAGE_SIZE 16384
+#endif
+
+// How often we ping the server to measure the round trip time. A ping that is still
+// unanswered when the next one is due closes the connection with ERR_TIMEOUT.
+#ifndef WS_PING_INTERVAL_MS
+#define WS_PING_INTERVAL_MS 15000
+#endif
+
+// Frames are assembled and masked here before being handed to tcp_base::write,
+// larger frames are written in several pieces
+#ifndef WS_TX_BUFFER_SIZE
+#define WS_TX_BUFFER_SIZE 512
+#endif
+
+static_assert(WS_TX_BUFFER_SIZE >= 14, "WS_TX_BUFFER_SIZE must hold the largest frame header");
+
+// Frames that can't be sent right away wait in a queue of at most this many bytes (control frames are always queued)
+#ifndef WS_TX_QUEUE_LIMIT
+#define WS_TX_QUEUE_LIMIT 16384
+#endif
+
+class eio_websocket_transport;
 
 namespace ws {
     constexpr uint8_t final_fragment = 0x80;
     constexpr uint8_t additional_fragment = 0x00;
+    constexpr uint8_t compressed = 0x40;
     constexpr uint8_t masked = 0x80;
     constexpr uint8_t has_length_16 = 0x7E;
     constexpr uint8_t has_length_64 = 0x7F;
@@ -30,37 +67,203 @@ namespace ws {
         pong
     };
 
+    inline std::span<const uint8_t> bytes_of(std::string_view text) {
+        return {(const uint8_t*)text.data(), text.size()};
+    }
+
+    // RFC 6455 7.4.1
+    enum class close_status : uint16_t {
+        normal = 1000,
+        protocol_error = 1002,
+        invalid_data = 1007,
+        message_too_big = 1009
+    };
+
+    // Outbound traffic classes, lower ones are sent first
+    enum class priority : uint8_t {
+        // Websocket ping, pong and close, never rate limited
+        control,
+        // Keepalives of the protocol on top, e.g. Engine.IO pongs
+        protocol,
+        normal,
+        count
+    };
+
+    // Allows rate bytes per second on average and bursts of up to burst bytes, a rate of 0 is unlimited
+    struct token_bucket {
+        uint32_t rate = 0, burst = 0;
+        int64_t tokens = 0;
+        absolute_time_t updated;
+
+        void refill(absolute_time_t now);
+        // Frames larger than the burst go through once the bucket is full
+        bool allows(size_t size) const;
+        void take(size_t size);
+    };
+
+    // How fragmented messages are handed to the on_receive callback
+    enum class fragment_mode : uint8_t {
+        // Collect all fragments and deliver the message once
+        reassemble,
+        // Deliver every fragment as soon as it is complete, see frame_info::first and final
+        stream
+    };
+
+    struct deflate_options {
+        bool enabled = false;
+        uint8_t server_max_window_bits = WS_DEFLATE_WINDOW_BITS;
+        bool server_no_context_takeover = false;
+
+        // Value for the Sec-WebSocket-Extensions request header
+        std::string offer() const;
+        // Parses the server's Sec-WebSocket-Extensions response header
+        static deflate_options negotiate(const std::string &header);
+    };
+
+    struct deflate_stats {
+        uint32_t frames = 0;
+        uint32_t last_compressed_size = 0, last_inflated_size = 0;
+        int64_t last_inflate_us = 0, total_inflate_us = 0;
+        uint64_t compressed_bytes = 0, inflated_bytes = 0;
+    };
+
+    // The frame being handed to the on_receive callback. For data the opcode is the
+    // message's (text or binary) even when the frame itself is a continuation.
+    struct frame_info {
+        opcodes opcode = opcodes::continuation;
+        bool first = false;
+        bool final = false;
+        bool compressed = false;
+        // Payload length on the wire
+        uint32_t size = 0;
+    };
+
     class websocket {
     public:
-        friend class ::eio_client;
+        friend class ::eio_websocket_transport;
         websocket(tcp_base *socket);
         ~websocket();
 
-        // Needs up to 14 add'l bytes to encode packet
-        bool write_text(std::span<uint8_t> data);
-        bool write_binary(std::span<uint8_t> data);
+        bool write_text(std::span<const uint8_t> data);
+        bool write_binary(std::span<const uint8_t> data);
+        // Sends the pieces as the payload of a single frame without concatenating them first.
+        // Frames that can't go out right away (no room in the tcp send buffer, rate limited or
+        // behind other frames of the same or a higher class) are queued; control opcodes always
+        // use priority::control. Returns false when the frame was dropped.
+        bool write(opcodes opcode, std::span<const std::span<const uint8_t>> pieces, priority level = priority::normal);
+        bool write(opcodes opcode, std::initializer_list<std::span<const uint8_t>> pieces, priority level = priority::normal);
+        void set_rate_limit(priority level, uint32_t bytes_per_second, uint32_t burst_bytes);
+        // Bytes waiting in the outbound queue
+        size_t queued() const;
 
         void close(err_t reason = ERR_CLSD);
 
+        // Only valid inside the on_receive callback, reads stop at the end of the current frame's payload.
+        // Whatever the callback leaves unread is skipped.
         size_t read(std::span<uint8_t> data);
-        uint32_t received_packet_size();
+        uint32_t received_packet_size() const;
+        const frame_info &current_frame() const;
+
+        void set_fragment_mode(fragment_mode mode);
+        void set_max_message_size(size_t size);
 
         bool connected();
 
+        // 0 disables our pings, pings from the server are always answered
+        void set_ping_interval(uint32_t milliseconds);
+        // Round trip time of the last ping and its smoothed average (RFC 6298), -1 before the first pong
+        int64_t rtt_us() const;
+        int64_t smoothed_rtt_us() const;
+        // When data was last received
+        absolute_time_t last_activity() const;
+
+        // Enables decompression of RSV1 frames as negotiated during the upgrade
+        void enable_deflate(const deflate_options &options);
+        const deflate_stats &compression_stats() const;
+
         void on_receive(std::function<void()> callback);
+        // Hands binary messages to the callback in place instead of calling on_receive, they are
+        // consumed when it returns. second is only non-empty when the payload wraps around the tcp buffer.
+        void on_binary(std::function<void(std::span<const uint8_t> first, std::span<const uint8_t> second)> callback);
         void on_poll(uint8_t interval_seconds, std::function<void()> callback);
         void on_closed(std::function<void(err_t)> callback);
 
     private:
         tcp_base *tcp;
         std::function<void()> user_receive_callback, user_poll_callback;
+        std::function<void(std::span<const uint8_t>, std::span<const uint8_t>)> user_binary_callback;
         std::function<void(err_t)> user_close_callback;
         uint32_t packet_size;
+        uint8_t tx_buffer[WS_TX_BUFFER_SIZE];
+
+        struct queued_frame {
+            std::vector<uint8_t> data;
+            size_t sent = 0;
+        };
+        std::array<std::deque<queued_frame>, (size_t)priority::count> queues;
+        std::array<token_bucket, (size_t)priority::count> buckets;
+        size_t queued_bytes = 0;
+        // Class whose first frame was only partly written, nothing else may go out until it is done
+        int sending = -1;
+
+        uint32_t ping_interval_ms = WS_PING_INTERVAL_MS;
+        uint32_t ping_sequence = 0;
+        bool ping_outstanding = false;
+        absolute_time_t ping_sent, last_activity_;
+        int64_t rtt_us_ = -1, smoothed_rtt_us_ = -1;
+
+        // Frames are decoded incrementally, partial headers and payloads wait for the next tcp callback
+        enum class decode_state : uint8_t {
+            header,
+            payload
+        };
+        decode_state state = decode_state::header;
+        uint8_t header[14];
+        uint8_t header_length = 0, header_needed = 2;
+        frame_info frame;
+        fragment_mode fragments = fragment_mode::reassemble;
+        size_t max_message_size = WS_MAX_MESSAGE_SIZE;
+        // State of the message the data frames belong to
+        bool in_message = false;
+        opcodes message_opcode = opcodes::text;
+        bool message_compressed = false;
+        size_t message_length = 0;
+        // Payload bytes of the current frame that have not been taken from the tcp buffer yet
+        uint32_t payload_remaining = 0;
+        uint8_t control_payload[125];
+        // The payload is collected in message instead of being read in place
+        bool buffered = false;
+        bool delivering = false;
+        // Set by the destructor so the decode loop notices when a callback deleted us
+        bool *destroyed = nullptr;
+
+        deflate_options deflate;
+        deflate_stats stats;
+        std::unique_ptr<inflater> decompressor;
+        // Decompressed payload of the current frame or one too large for the tcp buffer
+        std::vector<uint8_t> message;
+        size_t message_offset = 0;
 
-        void mask(std::span<uint8_t> data, uint32_t masking_key);
+        bool read_header();
+        bool start_frame();
+        bool read_payload();
+        bool inflate_payload();
+        bool dispatch_frame();
+        void skip_payload();
+        bool fail(close_status status, err_t reason);
+        void send_close(uint16_t code);
+        // refused: nothing reached tcp, the frame can still be queued. broken: the connection
+        // was closed part way through the frame.
+        enum class send_result : uint8_t {
+            sent,
+            refused,
+            broken
+        };
+        send_result send_frame(std::span<const uint8_t> header, std::span<const std::span<const uint8_t>> pieces, uint32_t masking_key);
+        void flush_queue();
+        int next_ready(const std::array<size_t, (size_t)priority::count> &merged, const std::array<token_bucket, (size_t)priority::count> &budget) const;
         void tcp_recv_callback();
         void tcp_poll_callback();
         void tcp_close_callback(err_t reason);
-        bool write_frame(std::span<uint8_t> data, opcodes opcode);
     };
 }
\ No newline at end of file
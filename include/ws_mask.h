@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+// The payload masking of RFC 6455 5.3, kept apart from the websocket so it builds on the host
+
+namespace ws {
+    // XORs data with the masking key as laid out in memory (RFC 6455 5.3). Unaligned
+    // head and tail bytes are done one at a time, everything in between a word at a time.
+    void mask(std::span<uint8_t> data, uint32_t masking_key);
+    // Same as mask() but writes the result to out, which must be at least as large as in.
+    // in and out may be the same buffer but must not overlap otherwise. When in and out are
+    // aligned differently each output word is assembled from two shifted source words.
+    void mask_copy(std::span<uint8_t> out, std::span<const uint8_t> in, uint32_t masking_key);
+
+    // The key to use from the given payload offset on, the first key byte is always the low one
+    inline uint32_t rotate_key(uint32_t key, size_t offset) {
+        uint32_t bits = (offset & 3) * 8;
+        return bits == 0 ? key : (key >> bits) | (key << (32 - bits));
+    }
+}
@@ -0,0 +1,246 @@
+#include "benchmarks.h"
+
+#ifdef PICO_BENCHMARKS
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <cmath>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <hardware/structs/systick.h>
+
+#include "websocket.h"
+#include "chacha_rng.h"
+#include "tcp_base.h"
+#include "event_table.h"
+#include "sio_sax.h"
+#include "sio_typed.h"
+#include "logger.h"
+
+extern "C" {
+    int mbedtls_hardware_poll(void *data, unsigned char *output, size_t len, size_t *olen);
+}
+
+namespace {
+    // The two fields pico_socket reads from "subscribed"
+    struct subscribed_temperatures {
+        float tempf = NAN;
+        float temp1f = NAN;
+    };
+}
+
+template <>
+struct json_binding<subscribed_temperatures> {
+    static constexpr std::tuple fields{
+        json_field{"0/devices/0/lastData/tempf", &subscribed_temperatures::tempf},
+        json_field{"0/devices/0/lastData/temp1f", &subscribed_temperatures::temp1f}
+    };
+};
+
+namespace {
+    constexpr uint32_t systick_max = 0x00FFFFFF;
+    constexpr int repetitions = 8;
+
+    // The M0+ has no cycle counter, but SysTick can count processor clocks (24 bit, counting down)
+    void start_cycle_counter() {
+        systick_hw->csr = 0;
+        systick_hw->rvr = systick_max;
+        systick_hw->cvr = 0;
+        // Enable, clocked from the processor
+        systick_hw->csr = 0x5;
+    }
+
+    inline uint32_t cycles_now() {
+        return systick_hw->cvr;
+    }
+
+    inline uint32_t cycles_since(uint32_t start) {
+        return (start - systick_hw->cvr) & systick_max;
+    }
+
+    template <typename F>
+    uint32_t best_of(F &&function) {
+        uint32_t best = UINT32_MAX;
+        for(int i = 0; i < repetitions; i++) {
+            uint32_t start = cycles_now();
+            function();
+            best = std::min(best, cycles_since(start));
+        }
+        return best;
+    }
+
+    // The byte at a time loop ws::mask replaced, kept as the baseline
+    void mask_bytewise(std::span<uint8_t> data, uint32_t masking_key) {
+        uint8_t *masking_bytes = (uint8_t*)&masking_key;
+        for(uint32_t i = 0; i < data.size(); i++) {
+            data[i] ^= masking_bytes[i % 4];
+        }
+    }
+
+    void benchmark_mask() {
+        static uint8_t source[16384 + 4] __attribute__((aligned(4)));
+        static uint8_t target[16384 + 4] __attribute__((aligned(4)));
+        static uint8_t expected[16384 + 4] __attribute__((aligned(4)));
+        constexpr uint32_t key = 0x9E3779B9;
+        for(size_t i = 0; i < sizeof(source); i++) {
+            source[i] = i * 31;
+        }
+
+        for(size_t size : {125u, 1024u, 16384u}) {
+            std::copy_n(source, size, expected);
+            mask_bytewise({expected, size}, key);
+            std::copy_n(source, size, target);
+            ws::mask({target, size}, key);
+            bool correct = std::equal(expected, expected + size, target);
+            ws::mask_copy({target + 1, size}, {source, size}, key);
+            correct = correct && std::equal(expected, expected + size, target + 1);
+
+            uint32_t bytewise = best_of([&]() { mask_bytewise({target, size}, key); });
+            uint32_t word = best_of([&]() { ws::mask({target, size}, key); });
+            uint32_t unaligned = best_of([&]() { ws::mask({target + 1, size}, key); });
+            uint32_t copy = best_of([&]() { ws::mask_copy({target, size}, {source, size}, key); });
+            uint32_t copy_misaligned = best_of([&]() { ws::mask_copy({target + 1, size}, {source, size}, key); });
+            // What misaligned copies used to do: memmove, then mask in place
+            uint32_t copy_two_pass = best_of([&]() {
+                memmove(target + 1, source, size);
+                ws::mask({target + 1, size}, key);
+            });
+            info("bench mask %5u B: bytewise %6u, word %6u (%u.%02u c/B), unaligned %6u, copy %6u, copy misaligned %6u (memmove + mask %6u) cycles%s\n",
+                size, bytewise, word, word / size, word * 100 / size % 100, unaligned, copy, copy_misaligned, copy_two_pass, correct ? "" : " MISMATCH");
+        }
+    }
+
+    // Connected transport that accepts and drops everything, so frame writes can be timed without the network
+    class discard_tcp : public tcp_base {
+    public:
+        bool init() override { return true; }
+        int available() const override { return 0; }
+        size_t read(std::span<uint8_t> out) override { return 0; }
+        std::array<std::span<const uint8_t>, 2> peek(size_t count) const override { return {}; }
+        size_t skip(size_t count) override { return 0; }
+        bool write(std::span<const uint8_t> data) override { return true; }
+        size_t sndbuf() const override { return SIZE_MAX; }
+        bool connect(std::string host, uint16_t port) override { return true; }
+        err_t close(err_t reason) override { return ERR_OK; }
+        bool connected() const override { return true; }
+        bool initialized() const override { return true; }
+        void on_receive(std::function<void()> callback) override {}
+        void on_connected(std::function<void()> callback) override {}
+        void on_poll(uint8_t interval_seconds, std::function<void()> callback) override {}
+        void on_sent(std::function<void(uint16_t)> callback) override {}
+        void on_closed(std::function<void(err_t)> callback) override {}
+    };
+
+    // The std::map sio_socket used: a std::string built from the packet, then find and operator[]
+    void benchmark_event_dispatch() {
+        for(size_t count : {4u, 8u, 16u, 32u, 64u}) {
+            std::vector<std::string> names;
+            std::map<std::string, int> map;
+            event_table<int> table;
+            for(size_t i = 0; i < count; i++) {
+                char name[24];
+                snprintf(name, sizeof(name), "weather_event_%u", i);
+                names.push_back(name);
+                map[name] = i;
+                table[name] = i;
+            }
+            table.freeze();
+
+            volatile int sink = 0;
+            uint32_t mapped = best_of([&]() {
+                for(const std::string &name : names) {
+                    std::string event(std::string_view(name.data(), name.size()));
+                    if(map.find(event) != map.end()) {
+                        sink = map[event];
+                    }
+                }
+            });
+            uint32_t hashed = best_of([&]() {
+                for(const std::string &name : names) {
+                    int *value = table.find(std::string_view(name.data(), name.size()));
+                    if(value) {
+                        sink = *value;
+                    }
+                }
+            });
+            info("bench dispatch %2u events: std::map %5u, event_table %5u cycles per lookup\n", count, mapped / count, hashed / count);
+        }
+    }
+
+    // A "subscribed" event as Ambient Weather sends it, with the key and address replaced
+    constexpr std::string_view subscribed_event = R"(["subscribed",{"devices":[{"macAddress":"00:00:00:00:00:00",)"
+        R"("lastData":{"dateutc":1718000000000,"tempinf":71.6,"humidityin":41,"baromrelin":29.921,"baromabsin":29.5,)"
+        R"("tempf":64.2,"battout":1,"humidity":72,"winddir":212,"windspeedmph":3.4,"windgustmph":5.8,"maxdailygust":11.4,)"
+        R"("hourlyrainin":0,"eventrainin":0,"dailyrainin":0,"weeklyrainin":0.12,"monthlyrainin":1.03,"totalrainin":14.2,)"
+        R"("solarradiation":312.5,"uv":3,"temp1f":68.9,"humidity1":48,"batt1":1,"feelsLike":64.2,"dewPoint":55.1,)"
+        R"("feelsLikein":70.9,"dewPointin":46.8,"feelsLike1":68.9,"dewPoint1":48.3,"lastRain":"2024-06-08T04:12:00.000Z",)"
+        R"("tz":"America/Los_Angeles","date":"2024-06-10T06:13:20.000Z"},)"
+        R"("info":{"name":"Backyard","coords":{"coords":{"lat":37.77,"lon":-122.42},"address":"",)"
+        R"("location":"San Francisco","elevation":16,"geo":{"type":"Point","coordinates":[-122.42,37.77]}}},)"
+        R"("apiKey":"0000000000000000000000000000000000000000000000000000000000000000"}],"method":"subscribe"}])";
+
+    // What dispatch did before the SAX path (DOM) against the typed handler it uses now
+    void benchmark_event_parse() {
+        volatile float sink = 0;
+        size_t heap_before = heap_in_use();
+        size_t dom_heap = 0;
+        uint32_t dom = best_of([&]() {
+            nlohmann::json body = nlohmann::json::parse(subscribed_event, nullptr, false);
+            dom_heap = std::max(dom_heap, heap_in_use());
+            sink = body[1]["devices"][0]["lastData"]["tempf"].get<float>() + body[1]["devices"][0]["lastData"]["temp1f"].get<float>();
+        });
+
+        sio_typed_handler<subscribed_temperatures> handler([&](const subscribed_temperatures &sample) {
+            sink = sample.tempf + sample.temp1f;
+        });
+        size_t sax_heap = 0;
+        uint32_t sax = best_of([&]() {
+            sio_event_sax parser(&handler);
+            parser.parse(subscribed_event);
+            sax_heap = std::max(sax_heap, parser.peak_heap());
+        });
+        info("bench subscribed event (%u B): dom %7u cycles, peak heap +%u B; sax %7u cycles, peak heap +%u B\n",
+            subscribed_event.size(), dom, dom_heap - heap_before, sax, sax_heap - heap_before);
+    }
+
+    void benchmark_masking_key() {
+        uint32_t key;
+        size_t olen;
+        uint32_t hardware = best_of([&]() { mbedtls_hardware_poll(nullptr, (uint8_t*)&key, sizeof(key), &olen); });
+        // Worst case is the call that has to run a ChaCha block, the other 15 are a load
+        key = chacha_rng::instance().next(); // seeds outside the measurement
+        uint32_t chacha = 0;
+        for(int i = 0; i < 16; i++) {
+            uint32_t start = cycles_now();
+            key = chacha_rng::instance().next();
+            chacha = std::max(chacha, cycles_since(start));
+        }
+
+        static uint8_t payload[125];
+        ws::websocket socket(new discard_tcp());
+        uint32_t frame = best_of([&]() { socket.write_text(payload); });
+        // The old write path paid for the hardware poll on every frame
+        uint32_t old_frame = best_of([&]() {
+            mbedtls_hardware_poll(nullptr, (uint8_t*)&key, sizeof(key), &olen);
+            socket.write_text(payload);
+        });
+        info("bench masking key: hardware poll %6u, chacha %6u cycles; 125 B frame write %6u cycles, with a hardware poll %6u\n",
+            hardware, chacha, frame, old_frame);
+    }
+}
+
+void run_benchmarks() {
+    start_cycle_counter();
+    benchmark_mask();
+    benchmark_masking_key();
+    benchmark_event_dispatch();
+    benchmark_event_parse();
+}
+
+#endif
@@ -0,0 +1,90 @@
+#include "chacha_rng.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "logger.h"
+
+extern "C" {
+    int mbedtls_hardware_poll(void *data, unsigned char *output, size_t len, size_t *olen);
+}
+
+namespace {
+    inline uint32_t rotl(uint32_t value, int bits) {
+        return (value << bits) | (value >> (32 - bits));
+    }
+
+    inline void quarter_round(uint32_t *x, int a, int b, int c, int d) {
+        x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 16);
+        x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 12);
+        x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 8);
+        x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 7);
+    }
+}
+
+chacha_rng &chacha_rng::instance() {
+    static chacha_rng rng;
+    return rng;
+}
+
+uint32_t chacha_rng::next() {
+    if(index == 16) {
+        generate();
+    }
+    return block[index++];
+}
+
+void chacha_rng::fill(std::span<uint8_t> out) {
+    while(out.size() > 0) {
+        uint32_t word = next();
+        size_t count = std::min(out.size(), sizeof(word));
+        memcpy(out.data(), &word, count);
+        out = out.subspan(count);
+    }
+}
+
+void chacha_rng::reseed() {
+    uint8_t key[32], nonce[12];
+    size_t olen;
+    mbedtls_hardware_poll(nullptr, key, sizeof(key), &olen);
+    mbedtls_hardware_poll(nullptr, nonce, sizeof(nonce), &olen);
+    seed(key, 0, nonce);
+    debug1("chacha_rng reseeded\n");
+}
+
+void chacha_rng::seed(std::span<const uint8_t, 32> key, uint32_t counter, std::span<const uint8_t, 12> nonce) {
+    // RFC 8439 2.3: constants, 256 bit key, 32 bit counter and 96 bit nonce, as little endian words
+    state[0] = 0x61707865;
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+    memcpy(&state[4], key.data(), key.size());
+    state[12] = counter;
+    memcpy(&state[13], nonce.data(), nonce.size());
+    blocks = 0;
+    index = 16;
+    seeded = true;
+}
+
+void chacha_rng::generate() {
+    if(!seeded || blocks >= CHACHA_RNG_RESEED_BLOCKS) {
+        reseed();
+    }
+    memcpy(block, state, sizeof(block));
+    for(int i = 0; i < 10; i++) {
+        quarter_round(block, 0, 4, 8, 12);
+        quarter_round(block, 1, 5, 9, 13);
+        quarter_round(block, 2, 6, 10, 14);
+        quarter_round(block, 3, 7, 11, 15);
+        quarter_round(block, 0, 5, 10, 15);
+        quarter_round(block, 1, 6, 11, 12);
+        quarter_round(block, 2, 7, 8, 13);
+        quarter_round(block, 3, 4, 9, 14);
+    }
+    for(int i = 0; i < 16; i++) {
+        block[i] += state[i];
+    }
+    state[12]++;
+    blocks++;
+    index = 0;
+}
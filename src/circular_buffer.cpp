@@ -1,9 +1,12 @@
 #include "circular_buffer.h"
 
+#include <algorithm>
+#include <string>
+
 template <class T>
 bool circular_buffer<T>::put(T item) {
     if(!full()) {
-        buf_[head_] = item;
+        buf_[head_] = std::move(item);
         head_ = (head_ + 1) % max_size_;
         return true;
     }
@@ -22,7 +25,7 @@ std::optional<T> circular_buffer<T>::get() {
     if(empty()) {
         return std::nullopt;
     }
-    T val = buf_[tail_];
+    T val = std::move(buf_[tail_]);
     tail_ = (tail_ + 1) % max_size_;
     return val;
 }
@@ -62,21 +65,8 @@ size_t circular_buffer<T>::capacity() const {
 
 template <class T>
 size_t circular_buffer<T>::size() const {
-    size_t size = max_size_;
-
-	if(!full())
-	{
-		if(head_ >= tail_)
-		{
-			size = head_ - tail_;
-		}
-		else
-		{
-			size = max_size_ + head_ - tail_;
-		}
-	}
-
-	return size;
+    // One slot always stays empty to tell a full buffer from an empty one
+    return (max_size_ + head_ - tail_) % max_size_;
 }
 
 template <class T>
@@ -84,6 +74,13 @@ void circular_buffer<T>::advance(size_t amount) {
     tail_ = (tail_ + amount) % max_size_;
 }
 
+template <class T>
+std::array<std::span<const T>, 2> circular_buffer<T>::peek(size_t count) const {
+    count = std::min(count, size());
+    size_t first = std::min(count, max_size_ - tail_);
+    return {std::span<const T>(buf_.get() + tail_, first), std::span<const T>(buf_.get(), count - first)};
+}
+
 template <class T>
 circular_buffer<T>::iterator circular_buffer<T>::begin() const {
     return iterator(buf_.get(), tail_, max_size_);
@@ -136,4 +133,5 @@ bool circular_buffer<T>::iterator::operator!=(const iterator& rhs) {
     return !(*this == rhs);
 }
 
-template class circular_buffer<uint8_t>;
\ No newline at end of file
+template class circular_buffer<uint8_t>;
+template class circular_buffer<std::string>;
\ No newline at end of file
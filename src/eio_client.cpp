@@ -1,74 +1,99 @@
 #include "eio_client.h"
+#include <algorithm>
+#include <array>
 #include <charconv>
 #include <cstring>
 #include "hardware/watchdog.h"
-#include "nlohmann/json.hpp"
+#include "pico/cyw43_arch.h"
 
-class eio_packet {
-public:
-    eio_packet(): payload(14, ' ') {}
-
-    eio_packet& operator+=(const std::string rhs) {
-        payload += rhs;
-        return *this;
+namespace {
+    ws::websocket *open_websocket(tcp_base *socket, const ws::deflate_options &deflate) {
+        ws::websocket *websocket = new ws::websocket(socket);
+        if(deflate.enabled) {
+            websocket->enable_deflate(deflate);
+        }
+        return websocket;
     }
+}
 
-    eio_packet& operator+=(const char rhs) {
-        payload += rhs;
-        return *this;
-    }
+eio_client::eio_client(eio_transport *transport): transport_(transport), ping_deadline{.do_work = ping_deadline_expired, .user_data = this}, open_(false), refresh_watchdog_(false) {
+    trace1("eio_client (ctor)\n");
+    bind_transport();
+}
 
-    std::span<uint8_t> span() {
-        return {(uint8_t*)payload.data() + 14, payload.size() - 14};
-    }
+eio_client::eio_client(ws::websocket *socket): eio_client(new eio_websocket_transport(socket)) {
+}
 
-    const char* c_str() const noexcept {
-        return payload.c_str();
-    }
+eio_client::eio_client(tcp_base *socket, ws::deflate_options deflate): eio_client(open_websocket(socket, deflate)) {
+}
 
-private:
-    std::string payload;
-};
+eio_client::~eio_client() {
+    trace1("~eio_client\n");
+    disarm_ping_deadline();
+    delete retired;
+    delete transport_;
+}
 
-eio_client::eio_client(ws::websocket *socket): socket_(socket), ping_milliseconds(0), open_(false), refresh_watchdog_(false) {
-    trace1("eio_client (ctor)\n");
-    socket_->on_receive(std::bind(&eio_client::ws_recv_callback, this));
-    socket_->on_poll(1, std::bind(&eio_client::ws_poll_callback, this));
-    socket_->on_closed(std::bind(&eio_client::ws_close_callback, this, std::placeholders::_1));
+size_t eio_client::read(std::span<uint8_t> data) {
+    return transport_->read(data);
 }
 
-eio_client::eio_client(tcp_base *socket): ping_milliseconds(0), open_(false), refresh_watchdog_(false) {
-    trace1("eio_client (ctor)\n");
-    socket_ = new ws::websocket(socket);
-    socket_->on_receive(std::bind(&eio_client::ws_recv_callback, this));
-    socket_->on_poll(1, std::bind(&eio_client::ws_poll_callback, this));
-    socket_->on_closed(std::bind(&eio_client::ws_close_callback, this, std::placeholders::_1));
+bool eio_client::send_message(std::span<const uint8_t> data) {
+    debug("EIO send message: '%.*s'\n", data.size(), data.data());
+    std::span<const uint8_t> pieces[] = {data};
+    return send_message(std::span<const std::span<const uint8_t>>(pieces));
 }
 
-size_t eio_client::read(std::span<uint8_t> data) {
-    return socket_->read(data);
+bool eio_client::send_message(std::initializer_list<std::span<const uint8_t>> pieces) {
+    return send_message(std::span<const std::span<const uint8_t>>(pieces.begin(), pieces.size()));
 }
 
-bool eio_client::send_message(std::span<uint8_t> data) {
-    for(int i = -15; i < 0; i++) {
-        if(data[i] != ' ') {
-            error1("eio_client::send_message expects 15 extra space bytes before the beginning of the given span!\n");
-            return false;
-        }
+bool eio_client::send_message(std::span<const std::span<const uint8_t>> pieces) {
+    if(pieces.size() > max_message_pieces) {
+        error("eio_client::send_message got %u pieces, at most %u are supported\n", pieces.size(), max_message_pieces);
+        return false;
     }
-    data[-1] = (uint8_t)packet_type::message;
-    debug("EIO send message: '%*s'\n", data.size() + 1, data.data() - 1);
-    return socket_->write_text({data.data() - 1, data.size() + 1});
+    static constexpr uint8_t type = (uint8_t)packet_type::message;
+    std::array<std::span<const uint8_t>, max_message_pieces + 1> frame;
+    frame[0] = {&type, 1};
+    std::copy(pieces.begin(), pieces.end(), frame.begin() + 1);
+    return transport_->write(std::span<const std::span<const uint8_t>>(frame.data(), pieces.size() + 1));
 }
 
+// Without the packet type byte. Empty packets are dropped before anyone asks.
 uint32_t eio_client::packet_size() const {
-    return socket_->received_packet_size() - 1;
+    uint32_t size = transport_->packet_size();
+    return size > 0 ? size - 1 : 0;
+}
+
+const eio_handshake &eio_client::handshake() const {
+    return handshake_;
+}
+
+const eio_delay_histogram &eio_client::ping_delay() const {
+    return ping_delay_;
+}
+
+void eio_client::close() {
+    std::span<const uint8_t> packet[] = {{&close_packet, 1}};
+    transport_->write(packet, ws::priority::protocol);
+    open_ = false;
+    disarm_ping_deadline();
+    transport_->close(ERR_CLSD);
+}
+
+const char *eio_client::transport_name() const {
+    return transport_->name();
 }
 
 void eio_client::on_receive(std::function<void()> callback) {
     user_receive_callback = callback;
 }
 
+void eio_client::on_binary(std::function<void(std::span<const uint8_t>, std::span<const uint8_t>)> callback) {
+    user_binary_callback = callback;
+}
+
 void eio_client::on_closed(std::function<void(err_t)> callback) {
     user_close_callback = callback;
 }
@@ -79,7 +104,7 @@ void eio_client::on_open(std::function<void()> callback) {
 
 void eio_client::read_initial_packet() {
     debug1("Engine reading initial packet...\n");
-    socket_->tcp_recv_callback();
+    transport_->start();
     set_refresh_watchdog();
 }
 
@@ -87,20 +112,37 @@ void eio_client::set_refresh_watchdog() {
     refresh_watchdog_ = true;
 }
 
-void eio_client::ws_recv_callback() {
+void eio_client::transport_recv_callback() {
+    // Every Engine.IO packet starts with its type
+    if(transport_->packet_size() == 0) {
+        error1("EIO empty packet, dropping\n");
+        return;
+    }
     packet_type type;
-    socket_->read({(uint8_t*)&type, 1});
+    transport_->read({(uint8_t*)&type, 1});
     switch(type) {
     case packet_type::open:{
-        std::string packet;
-        packet.resize(packet_size());
-        socket_->read({(uint8_t*)packet.data(), packet.size()});
-        nlohmann::json body = nlohmann::json::parse(packet);
-        sid = body["sid"];
-        ping_interval = body["pingInterval"];
-        ping_timeout = body["pingTimeout"];
-        info("EIO Open:\n    sid=%s\n    pingInterval=%d\n    pingTimeout=%d\n", sid.c_str(), ping_interval, ping_timeout);
+        if(packet_size() > EIO_HANDSHAKE_MAX_SIZE) {
+            error("EIO open packet of %u bytes is larger than EIO_HANDSHAKE_MAX_SIZE\n", packet_size());
+            transport_->close(ERR_VAL);
+            break;
+        }
+        char packet[EIO_HANDSHAKE_MAX_SIZE];
+        size_t length = transport_->read({(uint8_t*)packet, packet_size()});
+        handshake_ = eio_handshake::parse({packet, length});
+        if(!handshake_.valid()) {
+            error("EIO open packet rejected (%d): '%.*s'\n", (int)handshake_.status, length, packet);
+            transport_->close(ERR_VAL);
+            break;
+        }
+        std::string_view sid = handshake_.sid();
+        info("EIO Open:\n    sid=%.*s\n    pingInterval=%u\n    pingTimeout=%u\n    maxPayload=%u\n",
+            (int)sid.size(), sid.data(), handshake_.ping_interval, handshake_.ping_timeout, handshake_.max_payload);
         open_ = true;
+        last_ping = get_absolute_time();
+        arm_ping_deadline();
+        transport_->opened(handshake_);
+        transport_->on_poll(EIO_POLL_INTERVAL_S, std::bind(&eio_client::transport_poll_callback, this));
         user_open_callback();
         break;
     }
@@ -108,15 +150,22 @@ void eio_client::ws_recv_callback() {
     case packet_type::close:
         debug1("EIO Close\n");
         open_ = false;
-        socket_->close(ERR_CLSD);
+        disarm_ping_deadline();
+        transport_->close(ERR_CLSD);
         break;
 
     case packet_type::ping:{
         debug1("EIO Ping\n");
-        ping_milliseconds = 0;
-        eio_packet response;
-        response += (char)packet_type::pong;
-        socket_->write_text(response.span());
+        absolute_time_t received = get_absolute_time();
+        arm_ping_deadline();
+        std::span<const uint8_t> packet[] = {{&pong_packet, 1}};
+        transport_->write(packet, ws::priority::protocol);
+        int64_t since_last_ms = absolute_time_diff_us(last_ping, received) / 1000;
+        last_ping = received;
+        ping_delay_.add(std::max<int64_t>(since_last_ms - handshake_.ping_interval, 0));
+        if(delay_log_interval > 0 && ping_delay_.count % delay_log_interval == 0) {
+            ping_delay_.log();
+        }
         break;
     }
 
@@ -124,6 +173,11 @@ void eio_client::ws_recv_callback() {
         debug1("EIO Message\n");
         user_receive_callback();
         break;
+
+    case packet_type::noop:
+        // Sent to end a long poll, e.g. during an upgrade
+        trace1("EIO Noop\n");
+        break;
     
     default:
         error("Unexpected packet type: %c\n", type);
@@ -131,21 +185,84 @@ void eio_client::ws_recv_callback() {
     }
 }
 
-void eio_client::ws_poll_callback() {
-    trace1("eio_client::ws_poll_callback\n");
+void eio_client::transport_binary_callback(std::span<const uint8_t> first, std::span<const uint8_t> second) {
+    debug("EIO Binary message (%u bytes)\n", first.size() + second.size());
+    if(!user_binary_callback) {
+        error1("EIO binary message with no handler, dropping\n");
+        return;
+    }
+    user_binary_callback(first, second);
+}
+
+void eio_client::transport_poll_callback() {
+    trace1("eio_client::transport_poll_callback\n");
     if(refresh_watchdog_) {
         watchdog_update();
         trace1("refreshed watchdog\n");
     }
-    if(open_) {
-        ping_milliseconds += 1000;
-        if(ping_milliseconds > ping_interval + ping_timeout) {
-            open_ = false;
-            socket_->close(ERR_TIMEOUT);
-        }
+    if(retired) {
+        delete retired;
+        retired = nullptr;
     }
 }
 
-void eio_client::ws_close_callback(err_t reason) {
+void eio_client::transport_close_callback(err_t reason) {
+    open_ = false;
+    disarm_ping_deadline();
     user_close_callback(reason);
-}
\ No newline at end of file
+}
+
+void eio_client::bind_transport() {
+    transport_->on_receive(std::bind(&eio_client::transport_recv_callback, this));
+    transport_->on_binary(std::bind(&eio_client::transport_binary_callback, this, std::placeholders::_1, std::placeholders::_2));
+    transport_->on_poll(open_ ? EIO_POLL_INTERVAL_S : 1, std::bind(&eio_client::transport_poll_callback, this));
+    transport_->on_closed(std::bind(&eio_client::transport_close_callback, this, std::placeholders::_1));
+    transport_->on_upgrade(std::bind(&eio_client::upgrade_callback, this, std::placeholders::_1));
+}
+
+void eio_client::upgrade_callback(eio_transport *next) {
+    info("EIO upgraded from %s to %s\n", transport_->name(), next->name());
+    delete retired;
+    retired = transport_;
+    transport_ = next;
+    bind_transport();
+}
+
+void eio_client::arm_ping_deadline() {
+    async_context_t *context = cyw43_arch_async_context();
+    async_context_remove_at_time_worker(context, &ping_deadline);
+    async_context_add_at_time_worker_in_ms(context, &ping_deadline, handshake_.ping_interval + handshake_.ping_timeout);
+}
+
+void eio_client::disarm_ping_deadline() {
+    async_context_remove_at_time_worker(cyw43_arch_async_context(), &ping_deadline);
+}
+
+// Runs from the async context like the lwIP callbacks, so closing the socket here is safe
+void eio_client::ping_deadline_expired(async_context_t *context, async_at_time_worker_t *worker) {
+    eio_client *self = (eio_client*)worker->user_data;
+    error("EIO no ping within %u ms, closing\n", self->handshake_.ping_interval + self->handshake_.ping_timeout);
+    self->open_ = false;
+    self->transport_->close(ERR_TIMEOUT);
+}
+void eio_delay_histogram::add(int64_t ms) {
+    size_t bucket = 0;
+    while(bucket < bucket_count - 1 && ms >= (2ll << bucket)) {
+        bucket++;
+    }
+    buckets[bucket]++;
+    count++;
+    max_ms = std::max(max_ms, ms);
+}
+
+void eio_delay_histogram::log() const {
+    info("EIO ping delay past pingInterval over %u pings (max %lld ms):\n", count, max_ms);
+    for(size_t i = 0; i < bucket_count - 1; i++) {
+        if(buckets[i] > 0) {
+            info_cont("    < %6lld ms: %u\n", 2ll << i, buckets[i]);
+        }
+    }
+    if(buckets[bucket_count - 1] > 0) {
+        info_cont("    >=%6lld ms: %u\n", 2ll << (bucket_count - 2), buckets[bucket_count - 1]);
+    }
+}
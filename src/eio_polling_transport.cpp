@@ -0,0 +1,273 @@
+#include "eio_polling_transport.h"
+
+#include <algorithm>
+
+#include "pico/cyw43_arch.h"
+
+eio_polling_transport::eio_polling_transport(url_view url, std::string target)
+    : url_(url)
+    , target_(target)
+    , user_receive_callback([](){})
+    , user_poll_callback([](){})
+    , user_close_callback([](err_t){})
+    , user_upgrade_callback([](eio_transport*){})
+    , poll_timer{.do_work = poll_timer_callback, .user_data = this}
+{
+    poll_http = new http_client(url_);
+    poll_http->on_response(std::bind(&eio_polling_transport::poll_response_callback, this));
+    send_http = new http_client(url_);
+    send_http->on_response(std::bind(&eio_polling_transport::send_response_callback, this));
+}
+
+eio_polling_transport::~eio_polling_transport() {
+    if(destroyed != nullptr) {
+        *destroyed = true;
+    }
+    async_context_remove_at_time_worker(cyw43_arch_async_context(), &poll_timer);
+    delete probe;
+    delete probe_http;
+    delete poll_http;
+    delete send_http;
+}
+
+const char *eio_polling_transport::name() const {
+    return "polling";
+}
+
+uint32_t eio_polling_transport::packet_size() const {
+    return packet_end - packet_start;
+}
+
+size_t eio_polling_transport::read(std::span<uint8_t> data) {
+    size_t count = std::min(data.size(), packet_end - read_position);
+    std::copy_n(payload.data() + read_position, count, data.data());
+    read_position += count;
+    return count;
+}
+
+bool eio_polling_transport::write(std::span<const std::span<const uint8_t>> pieces, ws::priority level) {
+    if(closed_) {
+        return false;
+    }
+    if(!outbound.empty()) {
+        outbound += EIO_RECORD_SEPARATOR;
+    }
+    for(std::span<const uint8_t> piece : pieces) {
+        outbound.append((const char*)piece.data(), piece.size());
+    }
+    flush();
+    return true;
+}
+
+void eio_polling_transport::close(err_t reason) {
+    if(closed_) {
+        return;
+    }
+    debug("eio_polling_transport::close (%d)\n", reason);
+    closed_ = true;
+    open_ = false;
+    async_context_remove_at_time_worker(cyw43_arch_async_context(), &poll_timer);
+    poll_http->on_response([](){});
+    send_http->on_response([](){});
+    user_close_callback(reason);
+}
+
+bool eio_polling_transport::connected() {
+    return !closed_;
+}
+
+// The first GET, without a sid, is the handshake
+void eio_polling_transport::start() {
+    poll();
+}
+
+void eio_polling_transport::opened(const eio_handshake &handshake) {
+    sid_ = handshake.sid();
+    open_ = true;
+    flush();
+    if(!handshake.websocket_upgrade || !upgrade_enabled) {
+        return;
+    }
+    debug1("eio_polling_transport probing websocket upgrade\n");
+    probe_http = new http_client(url_);
+    probe_http->on_response(std::bind(&eio_polling_transport::probe_response_callback, this));
+    probe_http->upgrade(request_target("websocket"));
+}
+
+void eio_polling_transport::on_receive(std::function<void()> callback) {
+    user_receive_callback = callback;
+}
+
+void eio_polling_transport::on_poll(uint8_t interval_seconds, std::function<void()> callback) {
+    user_poll_callback = callback;
+    poll_interval_ms = interval_seconds * 1000;
+    async_context_t *context = cyw43_arch_async_context();
+    async_context_remove_at_time_worker(context, &poll_timer);
+    if(!closed_) {
+        async_context_add_at_time_worker_in_ms(context, &poll_timer, poll_interval_ms);
+    }
+}
+
+void eio_polling_transport::on_closed(std::function<void(err_t)> callback) {
+    user_close_callback = callback;
+}
+
+void eio_polling_transport::on_upgrade(std::function<void(eio_transport*)> callback) {
+    user_upgrade_callback = callback;
+}
+
+void eio_polling_transport::disable_upgrade() {
+    upgrade_enabled = false;
+}
+
+std::string eio_polling_transport::request_target(std::string_view transport) const {
+    std::string target = target_ + "&transport=" + std::string(transport);
+    if(!sid_.empty()) {
+        target += "&sid=" + sid_;
+    }
+    return target;
+}
+
+void eio_polling_transport::poll() {
+    if(closed_ || paused || polling) {
+        return;
+    }
+    polling = true;
+    poll_http->get(request_target("polling"));
+}
+
+void eio_polling_transport::flush() {
+    if(!open_ || closed_ || paused || sending || outbound.empty()) {
+        return;
+    }
+    sending = true;
+    send_http->post(request_target("polling"), outbound);
+    outbound.clear();
+}
+
+// Hands the packets of the last GET to the receive callback one at a time, false if it deleted us
+bool eio_polling_transport::deliver() {
+    bool deleted = false;
+    destroyed = &deleted;
+    size_t start = 0;
+    while(start < payload.size() && !closed_) {
+        size_t end = std::min(payload.find(EIO_RECORD_SEPARATOR, start), payload.size());
+        if(end > start && payload[start] == 'b') {
+            error1("eio_polling_transport: base64 binary packets are not supported, skipping\n");
+        } else if(end > start) {
+            packet_start = read_position = start;
+            packet_end = end;
+            user_receive_callback();
+            if(deleted) {
+                return false;
+            }
+        }
+        start = end + 1;
+    }
+    destroyed = nullptr;
+    return true;
+}
+
+// Switches to the probed websocket once neither a GET nor a POST is outstanding
+void eio_polling_transport::upgrade_if_drained() {
+    if(!paused || polling || sending || probe == nullptr || closed_) {
+        return;
+    }
+    probe->on_receive([](){});
+    probe->on_closed([](err_t){});
+    eio_websocket_transport *next = new eio_websocket_transport(probe);
+    probe = nullptr;
+
+    static constexpr uint8_t upgrade = (uint8_t)'5';
+    std::span<const uint8_t> upgrade_packet[] = {{&upgrade, 1}};
+    next->write(upgrade_packet, ws::priority::protocol);
+    // Packets written while paused follow the upgrade packet
+    size_t start = 0;
+    while(start < outbound.size()) {
+        size_t end = std::min(outbound.find(EIO_RECORD_SEPARATOR, start), outbound.size());
+        std::span<const uint8_t> packet[] = {{(const uint8_t*)outbound.data() + start, end - start}};
+        next->write(packet, ws::priority::normal);
+        start = end + 1;
+    }
+    outbound.clear();
+
+    closed_ = true;
+    open_ = false;
+    async_context_remove_at_time_worker(cyw43_arch_async_context(), &poll_timer);
+    info1("eio_polling_transport upgraded to websocket\n");
+    user_upgrade_callback(next);
+}
+
+void eio_polling_transport::poll_response_callback() {
+    polling = false;
+    const http_response &response = poll_http->response();
+    if(response.status() != 200) {
+        error("eio_polling_transport: poll failed with %d %s\n", response.status(), response.get_status_text().c_str());
+        close(ERR_CLSD);
+        return;
+    }
+    payload = response.get_body();
+    if(!deliver()) {
+        return;
+    }
+    if(paused) {
+        upgrade_if_drained();
+    } else {
+        poll();
+    }
+}
+
+void eio_polling_transport::send_response_callback() {
+    sending = false;
+    const http_response &response = send_http->response();
+    if(response.status() != 200) {
+        error("eio_polling_transport: send failed with %d %s\n", response.status(), response.get_status_text().c_str());
+        close(ERR_CLSD);
+        return;
+    }
+    if(paused) {
+        upgrade_if_drained();
+    } else {
+        flush();
+    }
+}
+
+void eio_polling_transport::probe_response_callback() {
+    const http_response &response = probe_http->response();
+    if(response.status() != 101) {
+        info("eio_polling_transport: websocket upgrade refused (%d), staying on polling\n", response.status());
+        return;
+    }
+    probe = new ws::websocket(probe_http->release_tcp_client());
+    probe->on_receive(std::bind(&eio_polling_transport::probe_receive_callback, this));
+    probe->on_closed([this](err_t reason) {
+        info("eio_polling_transport: probe closed (%d), staying on polling\n", reason);
+        // The websocket is in the middle of calling us, it is deleted with the transport
+        paused = false;
+        poll();
+        flush();
+    });
+    static constexpr std::string_view probe_ping = "2probe";
+    probe->write_text(ws::bytes_of(probe_ping));
+}
+
+// The switch itself waits for the server to finish the outstanding GET, which it does with a noop
+void eio_polling_transport::probe_receive_callback() {
+    char reply[6];
+    size_t length = probe->read({(uint8_t*)reply, sizeof(reply)});
+    if(probe->received_packet_size() != sizeof(reply) || std::string_view(reply, length) != "3probe") {
+        error("eio_polling_transport: unexpected probe reply '%.*s'\n", length, reply);
+        probe->close(ERR_VAL);
+        return;
+    }
+    debug1("eio_polling_transport probe answered, pausing polling\n");
+    paused = true;
+}
+
+void eio_polling_transport::poll_timer_callback(async_context_t *context, async_at_time_worker_t *worker) {
+    eio_polling_transport *self = (eio_polling_transport*)worker->user_data;
+    async_context_add_at_time_worker_in_ms(context, worker, self->poll_interval_ms);
+    self->user_poll_callback();
+    // In case the probe was answered after polling had already drained
+    self->upgrade_if_drained();
+}
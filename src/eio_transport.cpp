@@ -0,0 +1,53 @@
+#include "eio_transport.h"
+
+eio_websocket_transport::eio_websocket_transport(ws::websocket *socket): socket_(socket) {
+}
+
+eio_websocket_transport::~eio_websocket_transport() {
+    delete socket_;
+}
+
+const char *eio_websocket_transport::name() const {
+    return "websocket";
+}
+
+uint32_t eio_websocket_transport::packet_size() const {
+    return socket_->received_packet_size();
+}
+
+size_t eio_websocket_transport::read(std::span<uint8_t> data) {
+    return socket_->read(data);
+}
+
+bool eio_websocket_transport::write(std::span<const std::span<const uint8_t>> pieces, ws::priority level) {
+    return socket_->write(ws::opcodes::text, pieces, level);
+}
+
+void eio_websocket_transport::close(err_t reason) {
+    socket_->close(reason);
+}
+
+bool eio_websocket_transport::connected() {
+    return socket_->connected();
+}
+
+// The server may have sent the open packet before the callbacks were set
+void eio_websocket_transport::start() {
+    socket_->tcp_recv_callback();
+}
+
+void eio_websocket_transport::on_receive(std::function<void()> callback) {
+    socket_->on_receive(callback);
+}
+
+void eio_websocket_transport::on_binary(std::function<void(std::span<const uint8_t>, std::span<const uint8_t>)> callback) {
+    socket_->on_binary(callback);
+}
+
+void eio_websocket_transport::on_poll(uint8_t interval_seconds, std::function<void()> callback) {
+    socket_->on_poll(interval_seconds, callback);
+}
+
+void eio_websocket_transport::on_closed(std::function<void(err_t)> callback) {
+    socket_->on_closed(callback);
+}
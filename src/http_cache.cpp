@@ -0,0 +1,177 @@
+#include "http_cache.h"
+
+#include <memory>
+#include <cstring>
+
+#ifdef HTTP_CACHE_FLASH_OFFSET
+#include <pico/flash.h>
+#include <pico/platform.h>
+#include <pico/cyw43_arch.h>
+#include <hardware/flash.h>
+#endif
+
+#include "logger.h"
+
+#ifdef HTTP_CACHE_FLASH_OFFSET
+static_assert(HTTP_CACHE_MAX_BODY <= FLASH_SECTOR_SIZE, "HTTP_CACHE_MAX_BODY must fit in a flash sector");
+static_assert(HTTP_CACHE_FLASH_OFFSET % FLASH_SECTOR_SIZE == 0, "HTTP_CACHE_FLASH_OFFSET must be sector aligned");
+
+namespace {
+    struct flash_write {
+        uint32_t offset;
+        const uint8_t *data;
+        size_t size;
+    };
+
+    // Runs with the other core locked out, since neither core may execute from flash while it is written
+    void program_sector(void *param) {
+        flash_write *write = (flash_write*)param;
+        flash_range_erase(write->offset, FLASH_SECTOR_SIZE);
+        flash_range_program(write->offset, write->data, write->size);
+    }
+}
+#endif
+
+http_cache &http_cache::instance() {
+    static http_cache cache;
+    return cache;
+}
+
+const http_cache::entry *http_cache::find(const std::string &url) {
+    return lookup(url);
+}
+
+http_cache::entry *http_cache::lookup(const std::string &url) {
+    for(entry &slot : entries) {
+        if(slot.url == url) {
+            return &slot;
+        }
+    }
+    return nullptr;
+}
+
+void http_cache::store(const std::string &url, const std::string &etag, const std::string &last_modified, std::string_view body) {
+    if(body.size() > HTTP_CACHE_MAX_BODY) {
+        debug("http_cache: not caching %s (%d bytes)\n", url.c_str(), body.size());
+        erase(url);
+        return;
+    }
+
+    entry *target = lookup(url);
+    if(target != nullptr && contents(*target) == body) {
+        // Same body under new validators, nothing to write
+        target->etag = etag;
+        target->last_modified = last_modified;
+        target->last_used = ++use_counter;
+        debug("http_cache: %s unchanged (%d bytes)\n", url.c_str(), body.size());
+        return;
+    }
+    if(target == nullptr) {
+        // Least recently used slot, empty slots have never been used
+        target = &entries[0];
+        for(entry &slot : entries) {
+            if(slot.last_used < target->last_used) {
+                target = &slot;
+            }
+        }
+    }
+
+    target->url = url;
+    target->etag = etag;
+    target->last_modified = last_modified;
+    target->size = body.size();
+    target->last_used = ++use_counter;
+    // This runs from the lwIP receive callback, so the flash write is left to persist()
+    target->in_flash = false;
+    target->body.assign(body);
+#ifdef HTTP_CACHE_FLASH_OFFSET
+    target->dirty = true;
+#endif
+    debug("http_cache: stored %s (%d bytes, etag '%s')\n", url.c_str(), body.size(), etag.c_str());
+}
+
+bool http_cache::load(const std::string &url, std::string &body) {
+    entry *slot = lookup(url);
+    if(slot == nullptr) {
+        misses_++;
+        return false;
+    }
+    slot->last_used = ++use_counter;
+    hits_++;
+    body.assign(contents(*slot));
+    return true;
+}
+
+void http_cache::erase(const std::string &url) {
+    entry *slot = lookup(url);
+    if(slot != nullptr) {
+        *slot = {};
+    }
+}
+
+std::string_view http_cache::contents(const entry &slot) const {
+    if(slot.in_flash) {
+        return read_flash(&slot - entries.data(), slot.size);
+    }
+    return slot.body;
+}
+
+bool http_cache::write_flash(size_t index, std::string_view body) {
+#ifdef HTTP_CACHE_FLASH_OFFSET
+    // flash_range_program needs whole pages from RAM
+    size_t padded_size = (body.size() + FLASH_PAGE_SIZE - 1) & ~(FLASH_PAGE_SIZE - 1);
+    std::unique_ptr<uint8_t[]> padded(new uint8_t[padded_size]);
+    memset(padded.get(), 0xFF, padded_size);
+    memcpy(padded.get(), body.data(), body.size());
+
+    flash_write write = {(uint32_t)(HTTP_CACHE_FLASH_OFFSET + index * FLASH_SECTOR_SIZE), padded.get(), padded_size};
+    int rc = flash_safe_execute(program_sector, &write, 100);
+    if(rc != PICO_OK) {
+        error("http_cache: flash write failed (%d), keeping body in RAM\n", rc);
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+std::string_view http_cache::read_flash(size_t index, uint32_t size) const {
+#ifdef HTTP_CACHE_FLASH_OFFSET
+    return {(const char*)(XIP_BASE + HTTP_CACHE_FLASH_OFFSET + index * FLASH_SECTOR_SIZE), size};
+#else
+    return {};
+#endif
+}
+
+void http_cache::persist() {
+#ifdef HTTP_CACHE_FLASH_OFFSET
+    if(__get_current_exception() != 0) {
+        error1("http_cache::persist called from an interrupt, not writing flash\n");
+        return;
+    }
+    if(!is_nil_time(last_flash_write) && absolute_time_diff_us(get_absolute_time(), delayed_by_ms(last_flash_write, HTTP_CACHE_FLASH_INTERVAL_MS)) > 0) {
+        return;
+    }
+    // Keeps the receive callbacks, which call store(), out while the entries change
+    cyw43_arch_lwip_begin();
+    bool wrote = false;
+    for(entry &slot : entries) {
+        if(!slot.dirty) {
+            continue;
+        }
+        slot.dirty = false;
+        wrote = true;
+        if(write_flash(&slot - entries.data(), slot.body)) {
+            slot.in_flash = true;
+            slot.body.clear();
+            slot.body.shrink_to_fit();
+            debug("http_cache: moved %s to flash (%d bytes)\n", slot.url.c_str(), slot.size);
+        }
+    }
+    if(wrote) {
+        last_flash_write = get_absolute_time();
+    }
+    cyw43_arch_lwip_end();
+#endif
+}
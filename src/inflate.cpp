@@ -0,0 +1,595 @@
+#include "inflate.h"
+
+#include <algorithm>
+
+#include "logger.h"
+
+namespace {
+    constexpr uint16_t length_base[29] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+    };
+    constexpr uint8_t length_extra_bits[29] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+    };
+    constexpr uint16_t distance_base[30] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+    };
+    constexpr uint8_t distance_extra_bits[30] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+        7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+    };
+    constexpr uint8_t code_length_order[19] = {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+    };
+
+    // Half-byte CRC-32 table, trades a little speed for 960 bytes of flash
+    constexpr uint32_t crc32_table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+    };
+
+    constexpr uint8_t gzip_flag_header_crc = 0x02;
+    constexpr uint8_t gzip_flag_extra = 0x04;
+    constexpr uint8_t gzip_flag_name = 0x08;
+    constexpr uint8_t gzip_flag_comment = 0x10;
+}
+
+inflater::inflater(format fmt, uint8_t window_bits)
+    : requested_format(fmt)
+    , output_callback([](std::span<const uint8_t>){})
+{
+    window_bits = std::clamp<uint8_t>(window_bits, INFLATE_MIN_WINDOW_BITS, INFLATE_MAX_WINDOW_BITS);
+    window = std::unique_ptr<uint8_t[]>(new uint8_t[1u << window_bits]);
+    window_mask = (1u << window_bits) - 1;
+    reset();
+}
+
+void inflater::reset(bool keep_window) {
+    format_ = requested_format;
+    state_ = state::header;
+    if(!keep_window) {
+        window_pos = 0;
+        window_filled = 0;
+        flush_start = 0;
+    }
+    in_next = in_end = nullptr;
+    bit_buffer = 0;
+    bit_count = 0;
+    last_block = false;
+    index = 0;
+    header_bytes = 0;
+    checksum = format_ == format::gzip ? 0xFFFFFFFF : 1;
+    adler_b = 0;
+    total_in_ = 0;
+    total_out_ = 0;
+}
+
+bool inflater::finished() const {
+    return state_ == state::done;
+}
+
+bool inflater::failed() const {
+    return state_ == state::error;
+}
+
+size_t inflater::total_in() const {
+    return total_in_;
+}
+
+size_t inflater::total_out() const {
+    return total_out_;
+}
+
+inflater::status inflater::write(std::span<const uint8_t> input) {
+    in_next = input.data();
+    in_end = input.data() + input.size();
+    status result = run();
+    if(result != status::error) {
+        flush();
+    }
+    in_next = in_end = nullptr;
+    return result;
+}
+
+bool inflater::need(uint8_t bits) {
+    while(bit_count < bits) {
+        if(in_next == in_end) {
+            return false;
+        }
+        bit_buffer |= (uint32_t)*in_next++ << bit_count;
+        bit_count += 8;
+        total_in_++;
+    }
+    return true;
+}
+
+uint32_t inflater::take(uint8_t bits) {
+    uint32_t value;
+    if(bits == 32) {
+        value = bit_buffer;
+        bit_buffer = 0;
+    } else {
+        value = bit_buffer & ((1u << bits) - 1);
+        bit_buffer >>= bits;
+    }
+    bit_count -= bits;
+    return value;
+}
+
+// Canonical Huffman decode one bit at a time (as in zlib's puff.c). Nothing is consumed
+// unless a whole code is available, so the decoder can resume after more input arrives.
+// Returns the symbol, -1 if more input is needed or -2 for an invalid code.
+int inflater::decode(const huffman &code) {
+    need(max_bits);
+    int value = 0, first = 0, symbol_index = 0;
+    for(int length = 1; length <= max_bits; length++) {
+        if(length > bit_count) {
+            return -1;
+        }
+        value |= (bit_buffer >> (length - 1)) & 1;
+        int count = code.count[length];
+        if(value - count < first) {
+            take(length);
+            return code.symbol[symbol_index + (value - first)];
+        }
+        symbol_index += count;
+        first += count;
+        first <<= 1;
+        value <<= 1;
+    }
+    return -2;
+}
+
+// Returns 0 for a complete code, > 0 for an incomplete code and < 0 for an over-subscribed code
+int inflater::build(huffman &code, const uint16_t *lengths, int n) {
+    std::fill(code.count, code.count + max_bits + 1, 0);
+    for(int symbol = 0; symbol < n; symbol++) {
+        code.count[lengths[symbol]]++;
+    }
+    if(code.count[0] == n) {
+        return 0;
+    }
+
+    int left = 1;
+    for(int length = 1; length <= max_bits; length++) {
+        left <<= 1;
+        left -= code.count[length];
+        if(left < 0) {
+            return left;
+        }
+    }
+
+    uint16_t offsets[max_bits + 1];
+    offsets[1] = 0;
+    for(int length = 1; length < max_bits; length++) {
+        offsets[length + 1] = offsets[length] + code.count[length];
+    }
+    for(int symbol = 0; symbol < n; symbol++) {
+        if(lengths[symbol] != 0) {
+            code.symbol[offsets[lengths[symbol]]++] = symbol;
+        }
+    }
+    return left;
+}
+
+void inflater::build_fixed() {
+    int symbol = 0;
+    for(; symbol < 144; symbol++) lengths[symbol] = 8;
+    for(; symbol < 256; symbol++) lengths[symbol] = 9;
+    for(; symbol < 280; symbol++) lengths[symbol] = 7;
+    for(; symbol < fixed_literal_codes; symbol++) lengths[symbol] = 8;
+    build(literal_code, lengths, fixed_literal_codes);
+
+    std::fill(lengths, lengths + max_distance_codes, 5);
+    build(distance_code, lengths, max_distance_codes);
+}
+
+void inflater::put(uint8_t byte) {
+    window[window_pos++] = byte;
+    if(window_filled <= window_mask) {
+        window_filled++;
+    }
+    total_out_++;
+    if(window_pos > window_mask) {
+        flush();
+        window_pos = 0;
+        flush_start = 0;
+    }
+}
+
+void inflater::copy(uint32_t distance, uint32_t length) {
+    while(length--) {
+        put(window[(window_pos - distance) & window_mask]);
+    }
+}
+
+void inflater::flush() {
+    if(window_pos <= flush_start) {
+        return;
+    }
+    std::span<const uint8_t> data = {window.get() + flush_start, window_pos - flush_start};
+    flush_start = window_pos;
+    update_checksum(data);
+    output_callback(data);
+}
+
+void inflater::update_checksum(std::span<const uint8_t> data) {
+    if(format_ == format::gzip) {
+        for(uint8_t byte : data) {
+            checksum ^= byte;
+            checksum = (checksum >> 4) ^ crc32_table[checksum & 0x0F];
+            checksum = (checksum >> 4) ^ crc32_table[checksum & 0x0F];
+        }
+    } else if(format_ == format::zlib) {
+        constexpr uint32_t adler_mod = 65521;
+        // 5552 is the most bytes that can be summed before the 32 bit sums can overflow
+        while(data.size() > 0) {
+            size_t chunk = std::min<size_t>(data.size(), 5552);
+            for(uint8_t byte : data.first(chunk)) {
+                checksum += byte;
+                adler_b += checksum;
+            }
+            checksum %= adler_mod;
+            adler_b %= adler_mod;
+            data = data.subspan(chunk);
+        }
+    }
+}
+
+void inflater::end_block() {
+    if(!last_block) {
+        state_ = state::block_header;
+        return;
+    }
+    // Trailers start on a byte boundary and checksum everything that was decoded
+    take(bit_count % 8);
+    flush();
+    index = 0;
+    state_ = state::trailer;
+}
+
+inflater::state inflater::gzip_next_state() const {
+    if(gzip_flags & gzip_flag_extra) {
+        return state::gzip_extra_length;
+    }
+    if(gzip_flags & gzip_flag_name) {
+        return state::gzip_name;
+    }
+    if(gzip_flags & gzip_flag_comment) {
+        return state::gzip_comment;
+    }
+    if(gzip_flags & gzip_flag_header_crc) {
+        return state::gzip_header_crc;
+    }
+    return state::block_header;
+}
+
+inflater::status inflater::fail(const char *reason) {
+    error("inflater: %s\n", reason);
+    state_ = state::error;
+    return status::error;
+}
+
+inflater::status inflater::run() {
+    while(true) {
+        switch(state_) {
+        case state::header:
+            if(format_ == format::raw) {
+                state_ = state::block_header;
+                break;
+            }
+            if(format_ == format::zlib) {
+                if(!need(16)) {
+                    return status::ok;
+                }
+                uint8_t cmf = bit_buffer & 0xFF, flg = (bit_buffer >> 8) & 0xFF;
+                if((cmf & 0x0F) != 8 || ((cmf << 8) | flg) % 31 != 0) {
+                    // Some servers send raw deflate for "Content-Encoding: deflate"
+                    debug1("inflater: no zlib header, assuming raw deflate\n");
+                    format_ = format::raw;
+                    state_ = state::block_header;
+                    break;
+                }
+                if(flg & 0x20) {
+                    return fail("zlib preset dictionaries are not supported");
+                }
+                take(16);
+                state_ = state::block_header;
+                break;
+            }
+            while(header_bytes < 10) {
+                if(!need(8)) {
+                    return status::ok;
+                }
+                uint8_t byte = take(8);
+                if((header_bytes == 0 && byte != 0x1F) || (header_bytes == 1 && byte != 0x8B) || (header_bytes == 2 && byte != 8)) {
+                    return fail("invalid gzip header");
+                }
+                if(header_bytes == 3) {
+                    gzip_flags = byte;
+                }
+                header_bytes++;
+            }
+            state_ = gzip_next_state();
+            break;
+
+        case state::gzip_extra_length:
+            if(!need(16)) {
+                return status::ok;
+            }
+            stored_remaining = take(16);
+            state_ = state::gzip_extra;
+            [[fallthrough]];
+        case state::gzip_extra:
+            while(stored_remaining > 0) {
+                if(!need(8)) {
+                    return status::ok;
+                }
+                take(8);
+                stored_remaining--;
+            }
+            gzip_flags &= ~gzip_flag_extra;
+            state_ = gzip_next_state();
+            break;
+
+        case state::gzip_name:
+        case state::gzip_comment:
+            while(true) {
+                if(!need(8)) {
+                    return status::ok;
+                }
+                if(take(8) == 0) {
+                    break;
+                }
+            }
+            gzip_flags &= state_ == state::gzip_name ? ~gzip_flag_name : ~gzip_flag_comment;
+            state_ = gzip_next_state();
+            break;
+
+        case state::gzip_header_crc:
+            if(!need(16)) {
+                return status::ok;
+            }
+            take(16);
+            gzip_flags &= ~gzip_flag_header_crc;
+            state_ = gzip_next_state();
+            break;
+
+        case state::block_header: {
+            if(!need(3)) {
+                return status::ok;
+            }
+            last_block = take(1);
+            uint8_t type = take(2);
+            if(type == 0) {
+                take(bit_count % 8);
+                state_ = state::stored_header;
+            } else if(type == 1) {
+                build_fixed();
+                state_ = state::codes;
+            } else if(type == 2) {
+                state_ = state::table_sizes;
+            } else {
+                return fail("invalid block type");
+            }
+            break;
+        }
+
+        case state::stored_header: {
+            if(!need(32)) {
+                return status::ok;
+            }
+            uint16_t length = take(16);
+            uint16_t inverse = take(16);
+            if(length != (uint16_t)~inverse) {
+                return fail("stored block length mismatch");
+            }
+            stored_remaining = length;
+            state_ = state::stored_copy;
+            [[fallthrough]];
+        }
+        case state::stored_copy:
+            while(stored_remaining > 0 && bit_count >= 8) {
+                put(take(8));
+                stored_remaining--;
+            }
+            while(stored_remaining > 0 && in_next != in_end) {
+                put(*in_next++);
+                total_in_++;
+                stored_remaining--;
+            }
+            if(stored_remaining > 0) {
+                return status::ok;
+            }
+            end_block();
+            break;
+
+        case state::table_sizes:
+            if(!need(14)) {
+                return status::ok;
+            }
+            hlit = take(5) + 257;
+            hdist = take(5) + 1;
+            hclen = take(4) + 4;
+            if(hlit > max_literal_codes || hdist > max_distance_codes) {
+                return fail("too many length or distance codes");
+            }
+            std::fill(lengths, lengths + 19, 0);
+            index = 0;
+            state_ = state::code_length_lengths;
+            [[fallthrough]];
+        case state::code_length_lengths:
+            while(index < hclen) {
+                if(!need(3)) {
+                    return status::ok;
+                }
+                lengths[code_length_order[index++]] = take(3);
+            }
+            // The code length code is only needed until the real tables are built, so borrow the distance table
+            if(build(distance_code, lengths, 19) != 0) {
+                return fail("incomplete code length code");
+            }
+            index = 0;
+            state_ = state::code_lengths;
+            [[fallthrough]];
+        case state::code_lengths:
+            while(index < hlit + hdist) {
+                int symbol = decode(distance_code);
+                if(symbol == -1) {
+                    return status::ok;
+                }
+                if(symbol < 0) {
+                    return fail("invalid code length code");
+                }
+                if(symbol < 16) {
+                    lengths[index++] = symbol;
+                    continue;
+                }
+                pending_symbol = symbol;
+                state_ = state::code_lengths_repeat;
+                break;
+            }
+            if(state_ == state::code_lengths) {
+                if(lengths[256] == 0) {
+                    return fail("missing end-of-block code");
+                }
+                int err = build(literal_code, lengths, hlit);
+                if(err < 0 || (err > 0 && hlit != literal_count[0] + literal_count[1])) {
+                    return fail("invalid literal/length code lengths");
+                }
+                err = build(distance_code, lengths + hlit, hdist);
+                if(err < 0 || (err > 0 && hdist != distance_count[0] + distance_count[1])) {
+                    return fail("invalid distance code lengths");
+                }
+                state_ = state::codes;
+            }
+            break;
+
+        case state::code_lengths_repeat: {
+            uint8_t bits = pending_symbol == 16 ? 2 : pending_symbol == 17 ? 3 : 7;
+            if(!need(bits)) {
+                return status::ok;
+            }
+            uint16_t value = 0, count;
+            if(pending_symbol == 16) {
+                if(index == 0) {
+                    return fail("repeat with no previous length");
+                }
+                value = lengths[index - 1];
+                count = 3 + take(2);
+            } else if(pending_symbol == 17) {
+                count = 3 + take(3);
+            } else {
+                count = 11 + take(7);
+            }
+            if(index + count > hlit + hdist) {
+                return fail("too many code lengths");
+            }
+            std::fill(lengths + index, lengths + index + count, value);
+            index += count;
+            state_ = state::code_lengths;
+            break;
+        }
+
+        case state::codes: {
+            int symbol = decode(literal_code);
+            if(symbol == -1) {
+                return status::ok;
+            }
+            if(symbol < 0) {
+                return fail("invalid literal/length code");
+            }
+            if(symbol < 256) {
+                put(symbol);
+                break;
+            }
+            if(symbol == 256) {
+                end_block();
+                break;
+            }
+            symbol -= 257;
+            if(symbol >= 29) {
+                return fail("invalid length symbol");
+            }
+            pending_symbol = symbol;
+            state_ = state::length_extra;
+            [[fallthrough]];
+        }
+        case state::length_extra:
+            if(!need(length_extra_bits[pending_symbol])) {
+                return status::ok;
+            }
+            pending_length = length_base[pending_symbol] + take(length_extra_bits[pending_symbol]);
+            state_ = state::distance;
+            [[fallthrough]];
+        case state::distance: {
+            int symbol = decode(distance_code);
+            if(symbol == -1) {
+                return status::ok;
+            }
+            if(symbol < 0 || symbol >= max_distance_codes) {
+                return fail("invalid distance code");
+            }
+            pending_symbol = symbol;
+            state_ = state::distance_extra;
+            [[fallthrough]];
+        }
+        case state::distance_extra: {
+            if(!need(distance_extra_bits[pending_symbol])) {
+                return status::ok;
+            }
+            uint32_t distance = distance_base[pending_symbol] + take(distance_extra_bits[pending_symbol]);
+            if(distance > window_filled) {
+                return fail("distance is further back than the window");
+            }
+            copy(distance, pending_length);
+            state_ = state::codes;
+            break;
+        }
+
+        case state::trailer:
+            if(format_ == format::raw) {
+                state_ = state::done;
+                break;
+            }
+            if(format_ == format::zlib) {
+                if(!need(32)) {
+                    return status::ok;
+                }
+                uint32_t expected = __builtin_bswap32(take(32));
+                if(expected != ((adler_b << 16) | checksum)) {
+                    return fail("adler32 mismatch");
+                }
+                state_ = state::done;
+                break;
+            }
+            // gzip: CRC-32 then the length modulo 2^32, both little endian
+            if(index == 0) {
+                if(!need(32)) {
+                    return status::ok;
+                }
+                if(take(32) != ~checksum) {
+                    return fail("crc32 mismatch");
+                }
+                index++;
+            }
+            if(!need(32)) {
+                return status::ok;
+            }
+            if(take(32) != (uint32_t)total_out_) {
+                return fail("gzip length mismatch");
+            }
+            state_ = state::done;
+            break;
+
+        case state::done:
+            return status::done;
+
+        case state::error:
+            return status::error;
+        }
+    }
+}
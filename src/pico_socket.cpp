@@ -5,19 +5,59 @@
 #include <hardware/gpio.h>
 #include <hardware/pwm.h>
 #include <string_view>
+#include <cmath>
 #include "nlohmann/json.hpp"
 
 #include "lwip/netif.h"
 
+#ifdef HTTP_CACHE_FLASH_OFFSET
+#include <pico/flash.h>
+#endif
+
 #include "logger.h"
 #include "sio_client.h"
 #include "max7219.h"
+#include "benchmarks.h"
 
 #define RED_GPIO   13
 #define GREEN_GPIO 14
 #define BLUE_GPIO  15
 
 using namespace std::string_view_literals;
+using namespace url_literals;
+
+struct weather_sample {
+    float tempf = NAN;
+    float temp1f = NAN;
+};
+
+// "subscribed" carries the last sample of every device
+struct subscribed_sample : weather_sample {};
+
+template <>
+struct json_binding<weather_sample> {
+    static constexpr std::tuple fields{
+        json_field{"0/tempf", &weather_sample::tempf},
+        json_field{"0/temp1f", &weather_sample::temp1f}
+    };
+};
+
+template <>
+struct json_binding<subscribed_sample> {
+    static constexpr std::tuple fields{
+        json_field{"0/devices/0/lastData/tempf", &subscribed_sample::tempf},
+        json_field{"0/devices/0/lastData/temp1f", &subscribed_sample::temp1f}
+    };
+};
+
+void show_sample(const weather_sample &sample) {
+    if(!std::isnan(sample.tempf)) {
+        max7219_write(sample.tempf);
+    }
+    if(!std::isnan(sample.temp1f)) {
+        max7219_write(sample.temp1f, 4);
+    }
+}
 
 
 void dump_bytes(const uint8_t *bptr, uint32_t len) {
@@ -129,6 +169,10 @@ void draw_frame(int idx) {
 bool stop_anim = false;
 
 void run_anim() {
+#ifdef HTTP_CACHE_FLASH_OFFSET
+    // Lets the http_cache pause this core while it writes to flash
+    flash_safe_execute_core_init();
+#endif
     max7219_write_reg(MAX7219_REG_DIGIT7, 0b01001110); // C
     max7219_write_reg(MAX7219_REG_DIGIT6, 0b00011101); // o
     max7219_write_reg(MAX7219_REG_DIGIT5, 0b00010101); // n
@@ -151,6 +195,10 @@ int main() {
     stdio_init_all();
     sleep_ms(10);
 
+#ifdef PICO_BENCHMARKS
+    run_benchmarks();
+#endif
+
     if(watchdog_caused_reboot()) {
         for(int i = 0; i < 3; i++) {
             cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, 1);
@@ -213,8 +261,9 @@ int main() {
     info1("Connecting to ambientweather...\n");
     const ip4_addr_t *address = netif_ip4_addr(netif_default);
     info("My IP Address is %d.%d.%d.%d\n", ip4_addr1(address), ip4_addr2(address), ip4_addr3(address), ip4_addr4(address));
-    sio_client client("https://rt2.ambientweather.net/", {{"api", "1"}, {"applicationKey", AMBIENT_WEATHER_APP_KEY}});
-    //sio_client client("http://192.168.0.13:8000/", {{"api", "1"}, {"applicationKey", AMBIENT_WEATHER_APP_KEY}});
+    sio_client client("https://rt2.ambientweather.net/"_url, {{"api", "1"}, {"applicationKey", AMBIENT_WEATHER_APP_KEY}});
+    //sio_client client("http://192.168.0.13:8000/"_url, {{"api", "1"}, {"applicationKey", AMBIENT_WEATHER_APP_KEY}});
+    client.offer_deflate();
 
     
     client.on_open([&client](){
@@ -223,21 +272,19 @@ int main() {
     });
     debug1("set client open handler\n");
     
-    client.socket()->on("subscribed", [](nlohmann::json body){
-        info("Subscribed:\n%s\n", body[0].dump(4).c_str());
+    client.socket()->on<subscribed_sample>("subscribed", [](const subscribed_sample &sample){
+        info("Subscribed: tempf=%.1f temp1f=%.1f\n", sample.tempf, sample.temp1f);
         stop_anim = true;
         // Wait for animation to end
         sleep_us(5100);
         max7219_ensure_init();
-        max7219_write(body[0]["devices"][0]["lastData"]["tempf"]);
-        max7219_write(body[0]["devices"][0]["lastData"]["temp1f"], 4);
+        show_sample(sample);
     });
     debug1("set socket subscribed handler\n");
 
-    client.socket()->on("data", [](nlohmann::json body){
-        info("Data:\n%s\n", body[0].dump(4).c_str());
-        max7219_write(body[0]["tempf"]);
-        max7219_write(body[0]["temp1f"], 4);
+    client.socket()->on<weather_sample>("data", [](const weather_sample &sample){
+        info("Data: tempf=%.1f temp1f=%.1f\n", sample.tempf, sample.temp1f);
+        show_sample(sample);
     });
     debug1("set socket data handler\n");
 
@@ -246,10 +293,10 @@ int main() {
         pwm_set_gpio_level(BLUE_GPIO, 0x8000u);
         pwm_set_gpio_level(RED_GPIO, 0xFFFFu);
         pwm_set_gpio_level(GREEN_GPIO, 0x8000u);
-        nlohmann::json object;
+        // Serialized at compile time and sent as is
+        static constexpr std::string_view subscribe = R"(["subscribe",{"apiKeys":[")" AMBIENT_WEATHER_API_KEY R"("]}])";
         info1("Emitting subscribe event\n");
-        object["apiKeys"] = {AMBIENT_WEATHER_API_KEY};
-        client.socket()->emit("subscribe", object);
+        client.socket()->emit_serialized(subscribe);
     });
     debug1("set socket connect handler\n");
 
@@ -16,7 +16,9 @@ tcp_client::tcp_client()
     , remote_addr({0})
     , user_receive_callback([](){})
     , user_connected_callback([](){})
+    , user_poll_callback([](){})
     , user_closed_callback([](err_t){})
+    , user_sent_callback([](uint16_t){})
 {
     info1("Initializing DNS...\n");
     dns_init();
@@ -52,7 +54,41 @@ int tcp_client::available() const {
 }
 
 size_t tcp_client::read(std::span<uint8_t> out) {
-    return buffer.get(out);
+    size_t count = buffer.get(out);
+    if(pending != nullptr) {
+        cyw43_arch_lwip_begin();
+        drain_pending();
+        cyw43_arch_lwip_end();
+    }
+    return count;
+}
+
+std::array<std::span<const uint8_t>, 2> tcp_client::peek(size_t count) const {
+    return buffer.peek(count);
+}
+
+size_t tcp_client::skip(size_t count) {
+    count = std::min<size_t>(count, buffer.size());
+    buffer.advance(count);
+    if(pending != nullptr) {
+        cyw43_arch_lwip_begin();
+        drain_pending();
+        cyw43_arch_lwip_end();
+    }
+    return count;
+}
+
+void tcp_client::drain_pending() {
+    size_t count = 0;
+    while(pending != nullptr && !buffer.full()) {
+        size_t copied = buffer.put({reinterpret_cast<uint8_t*>(pending->payload), pending->len});
+        count += copied;
+        pending = pbuf_free_header(pending, copied);
+    }
+    // Only open the receive window for what actually made it into the buffer
+    if(count > 0 && tcp_controlblock != nullptr) {
+        tcp_recved(tcp_controlblock, count);
+    }
 }
 
 bool tcp_client::write(std::span<const uint8_t> data) {
@@ -63,6 +99,10 @@ bool tcp_client::write(std::span<const uint8_t> data) {
     return err == ERR_OK;
 }
 
+size_t tcp_client::sndbuf() const {
+    return tcp_controlblock != nullptr ? tcp_sndbuf(tcp_controlblock) : 0;
+}
+
 bool tcp_client::connected() const {
     return connected_;
 }
@@ -120,6 +160,10 @@ err_t tcp_client::close(err_t reason) {
         }
         tcp_controlblock = NULL;
     }
+    if(pending != nullptr) {
+        pbuf_free(pending);
+        pending = nullptr;
+    }
     connected_ = false;
     initialized_ = false;
     user_closed_callback(reason);
@@ -152,6 +196,7 @@ err_t tcp_client::poll_callback(void* arg, tcp_pcb* pcb) {
 err_t tcp_client::sent_callback(void* arg, tcp_pcb* pcb, u16_t len) {
     tcp_client *client = (tcp_client*)arg;
     info("Sent %d bytes\n", len);
+    client->user_sent_callback(len);
     return ERR_OK;
 }
 
@@ -163,18 +208,14 @@ err_t tcp_client::recv_callback(void* arg, tcp_pcb* pcb, pbuf* p, err_t err) {
         return client->close(ERR_CLSD);
     }
 
-    if(p->tot_len > 0) {
-        info("recv'ing %d bytes\n", p->tot_len);
-        // Receive the buffer
-        size_t count = 0;
-        pbuf* curr = p;
-        while(curr && !client->buffer.full()) {
-            count += client->buffer.put({reinterpret_cast<uint8_t*>(curr->payload), curr->len});
-            curr = curr->next;
-        }
-        tcp_recved(pcb, count);
+    info("recv'ing %d bytes\n", p->tot_len);
+    // Whatever does not fit in the buffer is kept and moved in as the application reads
+    if(client->pending != nullptr) {
+        pbuf_cat(client->pending, p);
+    } else {
+        client->pending = p;
     }
-    pbuf_free(p);
+    client->drain_pending();
 
     client->user_receive_callback();
 
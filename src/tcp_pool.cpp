@@ -0,0 +1,143 @@
+#include "tcp_pool.h"
+
+#include "pico/cyw43_arch.h"
+
+#include "tcp_client.h"
+#include "tcp_tls_client.h"
+#include "url_view.h"
+#include "logger.h"
+
+tcp_pool &tcp_pool::instance() {
+    static tcp_pool pool;
+    return pool;
+}
+
+tcp_base *tcp_pool::acquire(std::string_view scheme, std::string_view host, uint16_t port) {
+    evict_idle();
+    bool secure = is_secure(scheme);
+    for(entry &slot : entries) {
+        if(slot.tcp == nullptr || slot.secure != secure || slot.port != port || slot.host != host) {
+            continue;
+        }
+        if(!healthy(slot.tcp)) {
+            debug("tcp_pool::acquire dropping stale connection to %.*s:%d\n", (int)host.size(), host.data(), port);
+            evict(slot);
+            continue;
+        }
+        debug("tcp_pool::acquire reusing connection to %.*s:%d\n", (int)host.size(), host.data(), port);
+        tcp_base *to_return = slot.tcp;
+        slot = {};
+        return to_return;
+    }
+
+    if(secure) {
+        debug1("tcp_pool::acquire creating new tcp_tls_client\n");
+        return new tcp_tls_client();
+    }
+    debug1("tcp_pool::acquire creating new tcp_client\n");
+    return new tcp_client();
+}
+
+void tcp_pool::release(std::string_view scheme, std::string_view host, uint16_t port, tcp_base *tcp) {
+    if(tcp == nullptr) {
+        return;
+    }
+    tcp->on_connected([](){});
+    tcp->on_receive([](){});
+    tcp->on_closed([](err_t){});
+    tcp->on_sent([](uint16_t){});
+    tcp->on_poll(POLL_TIME_S, [](){});
+    if(!healthy(tcp)) {
+        debug("tcp_pool::release closing unhealthy connection to %.*s:%d\n", (int)host.size(), host.data(), port);
+        destroy(tcp);
+        return;
+    }
+
+    evict_idle();
+    entry *target = nullptr;
+    for(entry &slot : entries) {
+        if(slot.tcp == nullptr) {
+            target = &slot;
+            break;
+        }
+        if(target == nullptr || absolute_time_diff_us(slot.idle_since, target->idle_since) > 0) {
+            target = &slot;
+        }
+    }
+    if(target->tcp != nullptr) {
+        debug("tcp_pool::release pool full, evicting connection to %s:%d\n", target->host.c_str(), target->port);
+        evict(*target);
+    }
+
+    debug("tcp_pool::release pooling connection to %.*s:%d\n", (int)host.size(), host.data(), port);
+    target->tcp = tcp;
+    target->secure = is_secure(scheme);
+    target->host = host;
+    target->port = port;
+    target->idle_since = get_absolute_time();
+    arm_evict_timer();
+}
+
+void tcp_pool::evict_idle() {
+    absolute_time_t now = get_absolute_time();
+    for(entry &slot : entries) {
+        if(slot.tcp == nullptr) {
+            continue;
+        }
+        if(!healthy(slot.tcp) || absolute_time_diff_us(slot.idle_since, now) >= TCP_POOL_IDLE_TIMEOUT_MS * 1000ll) {
+            debug("tcp_pool::evict_idle closing connection to %s:%d\n", slot.host.c_str(), slot.port);
+            evict(slot);
+        }
+    }
+    arm_evict_timer();
+}
+
+void tcp_pool::arm_evict_timer() {
+    async_context_t *context = cyw43_arch_async_context();
+    async_context_remove_at_time_worker(context, &evict_timer);
+    absolute_time_t oldest = at_the_end_of_time;
+    for(const entry &slot : entries) {
+        if(slot.tcp != nullptr && absolute_time_diff_us(slot.idle_since, oldest) > 0) {
+            oldest = slot.idle_since;
+        }
+    }
+    if(!is_at_the_end_of_time(oldest)) {
+        async_context_add_at_time_worker_at(context, &evict_timer, delayed_by_ms(oldest, TCP_POOL_IDLE_TIMEOUT_MS));
+    }
+}
+
+// Runs from the async context like the lwIP callbacks, so closing connections here is safe
+void tcp_pool::evict_timer_callback(async_context_t *context, async_at_time_worker_t *worker) {
+    ((tcp_pool*)worker->user_data)->evict_idle();
+}
+
+size_t tcp_pool::idle_count() const {
+    size_t count = 0;
+    for(const entry &slot : entries) {
+        if(slot.tcp != nullptr) {
+            count++;
+        }
+    }
+    return count;
+}
+
+bool tcp_pool::is_secure(std::string_view scheme) {
+    return url_view::secure_scheme(scheme);
+}
+
+bool tcp_pool::healthy(const tcp_base *tcp) {
+    // Anything left in the receive buffer of an idle connection is either a close
+    // notification or a response we never asked for, neither of which is reusable.
+    return tcp->initialized() && tcp->connected() && tcp->available() == 0;
+}
+
+void tcp_pool::destroy(tcp_base *tcp) {
+    tcp->on_closed([](err_t){});
+    tcp->close(ERR_CLSD);
+    delete tcp;
+}
+
+void tcp_pool::evict(entry &slot) {
+    destroy(slot.tcp);
+    slot = {};
+}
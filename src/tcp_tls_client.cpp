@@ -37,7 +37,9 @@ tcp_tls_client::tcp_tls_client()
     , remote_addr({0})
     , user_receive_callback([](){})
     , user_connected_callback([](){})
-    , user_closed_callback([](err_t){}) {
+    , user_poll_callback([](){})
+    , user_closed_callback([](err_t){})
+    , user_sent_callback([](uint16_t){}) {
     if(tls_config == nullptr) {
         debug1("Creating tls_config...\n");
         tls_config = altcp_tls_create_config_client(NULL, 0);
@@ -60,6 +62,7 @@ bool tcp_tls_client::init() {
     altcp_sent(tcp_controlblock, sent_callback);
     altcp_recv(tcp_controlblock, recv_callback);
     altcp_err(tcp_controlblock, err_callback);
+    initialized_ = true;
 
     return true;
 }
@@ -69,7 +72,41 @@ int tcp_tls_client::available() const {
 }
 
 size_t tcp_tls_client::read(std::span<uint8_t> out) {
-    return buffer.get(out);
+    size_t count = buffer.get(out);
+    if(pending != nullptr) {
+        cyw43_arch_lwip_begin();
+        drain_pending();
+        cyw43_arch_lwip_end();
+    }
+    return count;
+}
+
+std::array<std::span<const uint8_t>, 2> tcp_tls_client::peek(size_t count) const {
+    return buffer.peek(count);
+}
+
+size_t tcp_tls_client::skip(size_t count) {
+    count = std::min<size_t>(count, buffer.size());
+    buffer.advance(count);
+    if(pending != nullptr) {
+        cyw43_arch_lwip_begin();
+        drain_pending();
+        cyw43_arch_lwip_end();
+    }
+    return count;
+}
+
+void tcp_tls_client::drain_pending() {
+    size_t count = 0;
+    while(pending != nullptr && !buffer.full()) {
+        size_t copied = buffer.put({reinterpret_cast<uint8_t*>(pending->payload), pending->len});
+        count += copied;
+        pending = pbuf_free_header(pending, copied);
+    }
+    // Only open the receive window for what actually made it into the buffer
+    if(count > 0 && tcp_controlblock != nullptr) {
+        altcp_recved(tcp_controlblock, count);
+    }
 }
 
 bool tcp_tls_client::connected() const {
@@ -95,6 +132,10 @@ bool tcp_tls_client::write(std::span<const uint8_t> data) {
     return err == ERR_OK;
 }
 
+size_t tcp_tls_client::sndbuf() const {
+    return tcp_controlblock != nullptr ? altcp_sndbuf(tcp_controlblock) : 0;
+}
+
 err_t tcp_tls_client::close(err_t reason) {
     err_t err = ERR_OK;
     if (tcp_controlblock != NULL) {
@@ -112,6 +153,10 @@ err_t tcp_tls_client::close(err_t reason) {
         }
         tcp_controlblock = NULL;
     }
+    if(pending != nullptr) {
+        pbuf_free(pending);
+        pending = nullptr;
+    }
     connected_ = false;
     initialized_ = false;
     user_closed_callback(reason);
@@ -180,28 +225,26 @@ err_t tcp_tls_client::recv_callback(void* arg, altcp_pcb* pcb, pbuf* p, err_t er
         return client->close(ERR_CLSD);
     }
 
-    if(p->tot_len > 0) {
-        debug("recv'ing %d bytes\n", p->tot_len);
-        // Receive the buffer
-        size_t count = 0;
-        pbuf* curr = p;
-        while(curr && !client->buffer.full()) {
-            count += client->buffer.put({reinterpret_cast<uint8_t*>(curr->payload), curr->len});
-            #if LOG_LEVEL <= LOG_LEVEL_TRACE
-            for(size_t i = 0; i < curr->len; i++) {
-                if(isprint(reinterpret_cast<uint8_t*>(curr->payload)[i])){
-                    printf("%c", reinterpret_cast<uint8_t*>(curr->payload)[i]);
-                } else {
-                    printf("\\x%02x ", reinterpret_cast<uint8_t*>(curr->payload)[i]);
-                }
+    debug("recv'ing %d bytes\n", p->tot_len);
+    #if LOG_LEVEL <= LOG_LEVEL_TRACE
+    for(pbuf* curr = p; curr; curr = curr->next) {
+        for(size_t i = 0; i < curr->len; i++) {
+            if(isprint(reinterpret_cast<uint8_t*>(curr->payload)[i])){
+                printf("%c", reinterpret_cast<uint8_t*>(curr->payload)[i]);
+            } else {
+                printf("\\x%02x ", reinterpret_cast<uint8_t*>(curr->payload)[i]);
             }
-            printf("\n");
-            #endif
-            curr = curr->next;
         }
-        altcp_recved(pcb, count);
     }
-    pbuf_free(p);
+    printf("\n");
+    #endif
+    // Whatever does not fit in the buffer is kept and moved in as the application reads
+    if(client->pending != nullptr) {
+        pbuf_cat(client->pending, p);
+    } else {
+        client->pending = p;
+    }
+    client->drain_pending();
 
     client->user_receive_callback();
 
@@ -216,7 +259,9 @@ err_t tcp_tls_client::poll_callback(void* arg, altcp_pcb* pcb) {
 }
 
 err_t tcp_tls_client::sent_callback(void* arg, altcp_pcb* pcb, uint16_t len) {
+    tcp_tls_client *client = (tcp_tls_client*)arg;
     debug("Sent %d bytes\n", len);
+    client->user_sent_callback(len);
     return ERR_OK;
 }
 
@@ -1,22 +1,83 @@
 #include "websocket.h"
+#include "chacha_rng.h"
 
 #include "lwip/ip_addr.h"
 
-ws::websocket::websocket(tcp_base *socket): tcp(socket), user_receive_callback([](){}), user_close_callback([](err_t){}) {
+#include <algorithm>
+#include <charconv>
+#include <string_view>
+
+std::string ws::deflate_options::offer() const {
+    std::string to_return = "permessage-deflate; server_max_window_bits=" + std::to_string(server_max_window_bits);
+    if(server_no_context_takeover) {
+        to_return += "; server_no_context_takeover";
+    }
+    return to_return;
+}
+
+ws::deflate_options ws::deflate_options::negotiate(const std::string &header) {
+    deflate_options to_return;
+    // Without the parameter the server may use the largest window
+    to_return.server_max_window_bits = INFLATE_MAX_WINDOW_BITS;
+    std::string_view extensions = header;
+    while(extensions.size() > 0) {
+        size_t extension_end = std::min(extensions.find(','), extensions.size());
+        std::string_view extension = extensions.substr(0, extension_end);
+        extensions.remove_prefix(std::min(extension_end + 1, extensions.size()));
+
+        bool first = true;
+        while(extension.size() > 0) {
+            size_t param_end = std::min(extension.find(';'), extension.size());
+            std::string_view param = extension.substr(0, param_end);
+            extension.remove_prefix(std::min(param_end + 1, extension.size()));
+            while(param.size() > 0 && param.front() == ' ') param.remove_prefix(1);
+            while(param.size() > 0 && param.back() == ' ') param.remove_suffix(1);
+
+            if(first) {
+                if(param != "permessage-deflate") {
+                    break;
+                }
+                to_return.enabled = true;
+                first = false;
+            } else if(param == "server_no_context_takeover") {
+                to_return.server_no_context_takeover = true;
+            } else if(param.starts_with("server_max_window_bits=")) {
+                param.remove_prefix(sizeof("server_max_window_bits=") - 1);
+                int bits = 0;
+                std::from_chars(param.begin(), param.end(), bits);
+                to_return.server_max_window_bits = std::clamp(bits, 8, INFLATE_MAX_WINDOW_BITS);
+            }
+        }
+        if(to_return.enabled) {
+            break;
+        }
+    }
+    return to_return;
+}
+
+ws::websocket::websocket(tcp_base *socket): tcp(socket), user_receive_callback([](){}), user_poll_callback([](){}), user_close_callback([](err_t){}) {
+    ping_sent = last_activity_ = get_absolute_time();
     tcp->on_receive(std::bind(&websocket::tcp_recv_callback, this));
+    tcp->on_poll(1, std::bind(&websocket::tcp_poll_callback, this));
+    tcp->on_sent([this](uint16_t) {
+        flush_queue();
+    });
     tcp->on_closed(std::bind(&websocket::tcp_close_callback, this, std::placeholders::_1));
 }
 
 ws::websocket::~websocket() {
+    if(destroyed != nullptr) {
+        *destroyed = true;
+    }
     delete tcp;
 }
 
-bool ws::websocket::write_text(std::span<uint8_t> data) {
-    return write_frame(data, opcodes::text);
+bool ws::websocket::write_text(std::span<const uint8_t> data) {
+    return write(opcodes::text, {data});
 }
 
-bool ws::websocket::write_binary(std::span<uint8_t> data) {
-    return write_frame(data, opcodes::binary);
+bool ws::websocket::write_binary(std::span<const uint8_t> data) {
+    return write(opcodes::binary, {data});
 }
 
 void ws::websocket::close(err_t reason) {
@@ -27,18 +88,82 @@ bool ws::websocket::connected() {
     return tcp->connected();
 }
 
+void ws::websocket::set_ping_interval(uint32_t milliseconds) {
+    ping_interval_ms = milliseconds;
+    ping_outstanding = false;
+}
+
+int64_t ws::websocket::rtt_us() const {
+    return rtt_us_;
+}
+
+int64_t ws::websocket::smoothed_rtt_us() const {
+    return smoothed_rtt_us_;
+}
+
+absolute_time_t ws::websocket::last_activity() const {
+    return last_activity_;
+}
+
+void ws::websocket::enable_deflate(const deflate_options &options) {
+    deflate = options;
+    if(!deflate.enabled) {
+        decompressor.reset();
+        return;
+    }
+    // zlib never uses a 256 byte window, it silently bumps 8 to 9 bits
+    uint8_t window_bits = std::max<uint8_t>(deflate.server_max_window_bits, 9);
+    info("ws::websocket using permessage-deflate (window %d bytes, context takeover %s)\n", 1 << window_bits, deflate.server_no_context_takeover ? "off" : "on");
+    decompressor = std::make_unique<inflater>(inflater::format::raw, window_bits);
+    decompressor->on_output([this](std::span<const uint8_t> decoded) {
+        message.insert(message.end(), decoded.begin(), decoded.end());
+        message_length += decoded.size();
+    });
+}
+
+const ws::deflate_stats &ws::websocket::compression_stats() const {
+    return stats;
+}
+
 size_t ws::websocket::read(std::span<uint8_t> data) {
-    return tcp->read(data);
+    if(!delivering) {
+        return 0;
+    }
+    if(buffered) {
+        size_t count = std::min(data.size(), message.size() - message_offset);
+        std::copy_n(message.data() + message_offset, count, data.data());
+        message_offset += count;
+        return count;
+    }
+    size_t count = tcp->read(data.first(std::min<size_t>(data.size(), payload_remaining)));
+    payload_remaining -= count;
+    return count;
 }
 
-uint32_t ws::websocket::received_packet_size() {
+uint32_t ws::websocket::received_packet_size() const {
     return packet_size;
 }
 
+const ws::frame_info &ws::websocket::current_frame() const {
+    return frame;
+}
+
+void ws::websocket::set_fragment_mode(fragment_mode mode) {
+    fragments = mode;
+}
+
+void ws::websocket::set_max_message_size(size_t size) {
+    max_message_size = size;
+}
+
 void ws::websocket::on_receive(std::function<void()> callback) {
     user_receive_callback = callback;
 }
 
+void ws::websocket::on_binary(std::function<void(std::span<const uint8_t>, std::span<const uint8_t>)> callback) {
+    user_binary_callback = callback;
+}
+
 void ws::websocket::on_poll(uint8_t interval_seconds, std::function<void()> callback) {
     tcp->on_poll(interval_seconds, std::bind(&websocket::tcp_poll_callback, this));
     user_poll_callback = callback;
@@ -48,57 +173,290 @@ void ws::websocket::on_closed(std::function<void(err_t)> callback) {
     user_close_callback = callback;
 }
 
-void ws::websocket::mask(std::span<uint8_t> data, uint32_t masking_key) {
-    std::span<uint8_t> masking_bytes = {(uint8_t*)&masking_key, sizeof(masking_key)};
-    for(uint32_t i = 0; i < data.size(); i++) {
-        data[i] ^= masking_bytes[i % 4];
+void ws::websocket::tcp_recv_callback() {
+    // A segment may hold several frames and a frame may span several segments, so decode
+    // as far as the buffered data allows and continue from the same state next time.
+    // Every step returns false when it needs more data or the connection went away.
+    last_activity_ = get_absolute_time();
+    while(true) {
+        if(state == decode_state::header && (!read_header() || !start_frame())) {
+            return;
+        }
+        if(!read_payload() || !dispatch_frame()) {
+            return;
+        }
+    }
+}
+
+bool ws::websocket::read_header() {
+    while(header_length < header_needed) {
+        size_t count = tcp->read({header + header_length, (size_t)(header_needed - header_length)});
+        if(count == 0) {
+            return false;
+        }
+        header_length += count;
+        if(header_length == 2) {
+            uint8_t length = header[1] & 0x7F;
+            header_needed += length == has_length_16 ? 2 : length == has_length_64 ? 8 : 0;
+            header_needed += header[1] & masked ? 4 : 0;
+        }
     }
+    return true;
 }
 
-void ws::websocket::tcp_recv_callback() {
-    if(!tcp->available()) {
-        return;
+bool ws::websocket::start_frame() {
+    uint64_t length = header[1] & 0x7F;
+    if(length == has_length_16) {
+        length = (header[2] << 8) | header[3];
+    } else if(length == has_length_64) {
+        length = 0;
+        for(int i = 2; i < 10; i++) {
+            length = (length << 8) | header[i];
+        }
+    }
+    frame.opcode = opcodes(header[0] & 0x0F);
+    frame.final = header[0] & final_fragment;
+    frame.compressed = header[0] & compressed;
+    bool is_masked = header[1] & masked;
+    debug("ws::websocket frame: %02x %02x, %llu bytes\n", header[0], header[1], length);
+    header_length = 0;
+    header_needed = 2;
+
+    // RFC 6455 5.1, 5.2 and 5.5: servers never mask, unknown opcodes are fatal and
+    // control frames are short and unfragmented
+    bool control = (uint8_t)frame.opcode & 0x08;
+    bool known = control ? frame.opcode <= opcodes::pong : frame.opcode <= opcodes::binary;
+    if(is_masked || !known || (control && (length > sizeof(control_payload) || !frame.final || frame.compressed))) {
+        error1("ws::websocket protocol error in frame header\n");
+        return fail(close_status::protocol_error, ERR_VAL);
+    }
+    if(length > UINT32_MAX) {
+        error("ws::websocket frame of %llu bytes is too large\n", length);
+        return fail(close_status::message_too_big, ERR_MEM);
+    }
+    frame.size = length;
+    payload_remaining = frame.size;
+    packet_size = frame.size;
+    state = decode_state::payload;
+    if(control) {
+        // Control frames may be interleaved with the fragments of a message and leave it alone
+        return true;
+    }
+
+    // Only the first frame of a message has a data opcode and may set RSV1
+    bool continuation = frame.opcode == opcodes::continuation;
+    if(continuation != in_message || (continuation && frame.compressed)) {
+        error("ws::websocket unexpected %s frame\n", continuation ? "continuation" : "data");
+        return fail(close_status::protocol_error, ERR_VAL);
     }
-    uint8_t frame_header[2];
-    tcp->read({frame_header, 2});
-    packet_size = frame_header[1] & 0x7F;
-    debug("Header: %02x %02x\n", frame_header[0], frame_header[1]);
-    debug("Header packet size: %x\n", packet_size);
-    if(packet_size == 0x7E) {
-        uint16_t temp;
-        tcp->read({(uint8_t*)&temp, 2});
-        packet_size = ntohs(temp);
-    } else if(packet_size == 0x7F) {
-        uint32_t temp;
-        tcp->read({(uint8_t*)&temp, 4});
-        tcp->read({(uint8_t*)&packet_size, 4});
-        packet_size = ntohl(packet_size);
-    }
-    debug("ws::websocket::tcp_recv_callback: Got size %u (0x%08x)\n", packet_size, packet_size);
-    switch(opcodes(frame_header[0] & 0x0F)) {
-    case opcodes::ping:
-        // Client should never receive a ping
+    frame.first = !continuation;
+    if(frame.first) {
+        in_message = true;
+        message_opcode = frame.opcode;
+        message_compressed = frame.compressed;
+        message_length = 0;
+        message.clear();
+        message_offset = 0;
+        if(message_compressed) {
+            if(!decompressor) {
+                error1("ws::websocket got a compressed frame without negotiating permessage-deflate\n");
+                return fail(close_status::protocol_error, ERR_VAL);
+            }
+            stats.last_compressed_size = 0;
+            stats.last_inflate_us = 0;
+        }
+    }
+    // Compressed messages are checked as they inflate
+    if(!message_compressed) {
+        if(frame.size > max_message_size - message_length) {
+            error("ws::websocket message exceeds %u bytes\n", max_message_size);
+            return fail(close_status::message_too_big, ERR_MEM);
+        }
+        message_length += frame.size;
+    }
+    // Compressed payloads, payloads that never fit in the tcp buffer at once and
+    // fragments that are being reassembled are collected in message
+    bool whole = frame.first && frame.final;
+    buffered = message_compressed || frame.size > BUF_SIZE - 1 || (fragments == fragment_mode::reassemble && !whole);
+    return true;
+}
+
+bool ws::websocket::read_payload() {
+    if((uint8_t)frame.opcode & 0x08) {
+        return tcp->available() >= (int)payload_remaining;
+    }
+    if(message_compressed) {
+        return inflate_payload();
+    }
+    if(!buffered) {
+        return tcp->available() >= (int)payload_remaining;
+    }
+    size_t offset = message.size();
+    message.resize(offset + std::min<size_t>(tcp->available(), payload_remaining));
+    size_t count = tcp->read({message.data() + offset, message.size() - offset});
+    payload_remaining -= count;
+    return payload_remaining == 0;
+}
+
+bool ws::websocket::dispatch_frame() {
+    state = decode_state::header;
+    switch(frame.opcode) {
+    case opcodes::ping:{
+        // RFC 6455 5.5.2: the pong carries the ping's application data
+        size_t count = tcp->read({control_payload, payload_remaining});
+        payload_remaining = 0;
+        write(opcodes::pong, {std::span<const uint8_t>(control_payload, count)});
         break;
-    case opcodes::pong:
-        // Reset timeout timer
+    }
+    case opcodes::pong:{
+        size_t count = tcp->read({control_payload, payload_remaining});
+        payload_remaining = 0;
+        // Unsolicited pongs are allowed and only count as activity
+        if(ping_outstanding && count == sizeof(ping_sequence) && memcmp(control_payload, &ping_sequence, count) == 0) {
+            ping_outstanding = false;
+            rtt_us_ = absolute_time_diff_us(ping_sent, get_absolute_time());
+            smoothed_rtt_us_ = smoothed_rtt_us_ < 0 ? rtt_us_ : (7 * smoothed_rtt_us_ + rtt_us_) / 8;
+            debug("ws::websocket pong after %lld us (smoothed %lld us)\n", rtt_us_, smoothed_rtt_us_);
+        }
         break;
+    }
+    case opcodes::continuation:
     case opcodes::binary:
-    case opcodes::text:
-        user_receive_callback();
+    case opcodes::text:{
+        if(frame.final) {
+            in_message = false;
+        } else if(fragments == fragment_mode::reassemble) {
+            // Wait for the rest of the message
+            break;
+        }
+        if(fragments == fragment_mode::reassemble) {
+            frame.first = true;
+        }
+        frame.opcode = message_opcode;
+        frame.compressed = message_compressed;
+        packet_size = buffered ? message.size() : frame.size;
+
+        bool deleted = false;
+        destroyed = &deleted;
+        delivering = true;
+        if(frame.opcode == opcodes::binary && user_binary_callback) {
+            if(buffered) {
+                user_binary_callback({message.data(), message.size()}, {});
+            } else {
+                std::array<std::span<const uint8_t>, 2> payload = tcp->peek(payload_remaining);
+                user_binary_callback(payload[0], payload[1]);
+            }
+        } else {
+            user_receive_callback();
+        }
+        if(deleted) {
+            return false;
+        }
+        destroyed = nullptr;
+        delivering = false;
+        skip_payload();
+        message.clear();
+        message_offset = 0;
         break;
+    }
     case opcodes::close:{
-        debug1("ws::websocket::tcp_recv_callback: Got close frame\n");
-        std::string data(' ', 14);
-        write_frame({(uint8_t*)data.data() + 14, data.size() - 14}, opcodes::close);
+        size_t count = tcp->read({control_payload, payload_remaining});
+        payload_remaining = 0;
+        uint16_t code = count >= 2 ? (control_payload[0] << 8) | control_payload[1] : 0;
+        debug("ws::websocket::tcp_recv_callback: Got close frame (%d)\n", code);
+        send_close(code);
         tcp->close(ERR_CLSD);
-        break;
+        return false;
     }
     default:
         break;
     }
+    return tcp->connected();
+}
+
+void ws::websocket::skip_payload() {
+    payload_remaining -= tcp->skip(payload_remaining);
+}
+
+bool ws::websocket::fail(close_status status, err_t reason) {
+    send_close((uint16_t)status);
+    tcp->close(reason);
+    return false;
+}
+
+void ws::websocket::send_close(uint16_t code) {
+    uint8_t payload[2] = {(uint8_t)(code >> 8), (uint8_t)(code & 0xFF)};
+    write(opcodes::close, {std::span<const uint8_t>(payload, code != 0 ? 2 : 0)});
+}
+
+bool ws::websocket::inflate_payload() {
+    absolute_time_t start = get_absolute_time();
+    uint8_t chunk[128];
+    while(payload_remaining > 0) {
+        size_t count = tcp->read({chunk, std::min<size_t>(sizeof(chunk), payload_remaining)});
+        if(count == 0) {
+            break;
+        }
+        payload_remaining -= count;
+        if(decompressor->write({chunk, count}) == inflater::status::error) {
+            error1("ws::websocket failed to inflate frame\n");
+            return fail(close_status::invalid_data, ERR_VAL);
+        }
+        if(message_length > max_message_size) {
+            error("ws::websocket message inflates to more than %u bytes\n", max_message_size);
+            return fail(close_status::message_too_big, ERR_MEM);
+        }
+    }
+    stats.last_inflate_us += absolute_time_diff_us(start, get_absolute_time());
+    if(payload_remaining > 0) {
+        return false;
+    }
+    stats.last_compressed_size += frame.size;
+    stats.compressed_bytes += frame.size;
+    if(!frame.final) {
+        return true;
+    }
+
+    // RFC 7692 7.2.2: the sender strips the empty stored block that ends each message
+    static constexpr uint8_t message_tail[] = {0x00, 0x00, 0xFF, 0xFF};
+    if(!decompressor->finished() && decompressor->write(message_tail) == inflater::status::error) {
+        error1("ws::websocket failed to inflate frame\n");
+        return fail(close_status::invalid_data, ERR_VAL);
+    }
+    if(message_length > max_message_size) {
+        error("ws::websocket message inflates to more than %u bytes\n", max_message_size);
+        return fail(close_status::message_too_big, ERR_MEM);
+    }
+    if(decompressor->finished()) {
+        decompressor->reset(!deflate.server_no_context_takeover);
+    } else if(deflate.server_no_context_takeover) {
+        decompressor->reset();
+    }
+
+    stats.frames++;
+    stats.last_inflated_size = message_length;
+    stats.total_inflate_us += stats.last_inflate_us;
+    stats.inflated_bytes += message_length;
+    info("ws::websocket inflated %u -> %u bytes (%u%%) in %lld us\n", stats.last_compressed_size, message_length, message_length > 0 ? stats.last_compressed_size * 100 / message_length : 100, stats.last_inflate_us);
+    return true;
 }
 
 void ws::websocket::tcp_poll_callback() {
+    // Rate limited frames are not tied to an ack
+    flush_queue();
+    if(ping_interval_ms > 0 && tcp->connected()) {
+        absolute_time_t now = get_absolute_time();
+        if(absolute_time_diff_us(ping_sent, now) >= ping_interval_ms * 1000ll) {
+            if(ping_outstanding) {
+                error("ws::websocket no pong within %u ms, closing\n", ping_interval_ms);
+                tcp->close(ERR_TIMEOUT);
+                return;
+            }
+            ping_sequence++;
+            ping_outstanding = write(opcodes::ping, {std::span<const uint8_t>((const uint8_t*)&ping_sequence, sizeof(ping_sequence))});
+            ping_sent = now;
+        }
+    }
     user_poll_callback();
 }
 
@@ -106,59 +464,241 @@ void ws::websocket::tcp_close_callback(err_t reason) {
     user_close_callback(reason);
 }
 
-#define htonll(x) ((((x) & (u64_t)0x00000000000000ffULL) << 56) | \
-                   (((x) & (u64_t)0x000000000000ff00ULL) << 40) | \
-                   (((x) & (u64_t)0x0000000000ff0000ULL) << 24) | \
-                   (((x) & (u64_t)0x00000000ff000000ULL) <<  8) | \
-                   (((x) & (u64_t)0x000000ff00000000ULL) >>  8) | \
-                   (((x) & (u64_t)0x0000ff0000000000ULL) >> 24) | \
-                   (((x) & (u64_t)0x00ff000000000000ULL) >> 40) | \
-                   (((x) & (u64_t)0xff00000000000000ULL) >> 56))
+bool ws::websocket::write(opcodes opcode, std::initializer_list<std::span<const uint8_t>> pieces, priority level) {
+    return write(opcode, std::span<const std::span<const uint8_t>>(pieces.begin(), pieces.size()), level);
+}
+
+bool ws::websocket::write(opcodes opcode, std::span<const std::span<const uint8_t>> pieces, priority level) {
+    if((uint8_t)opcode & 0x08) {
+        level = priority::control;
+    }
+    size_t size = 0;
+    for(std::span<const uint8_t> piece : pieces) {
+        size += piece.size();
+    }
+    uint32_t masking_key = chacha_rng::instance().next();
+
+    uint8_t header[14];
+    size_t header_size = 0;
+    header[header_size++] = final_fragment | (uint8_t)opcode;
+    if(size < has_length_16) {
+        header[header_size++] = masked | size;
+    } else if(size <= 0xFFFF) {
+        header[header_size++] = masked | has_length_16;
+        header[header_size++] = size >> 8;
+        header[header_size++] = size & 0xFF;
+    } else {
+        header[header_size++] = masked | has_length_64;
+        for(int shift = 56; shift >= 0; shift -= 8) {
+            header[header_size++] = (uint64_t)size >> shift;
+        }
+    }
+    memcpy(header + header_size, &masking_key, sizeof(masking_key));
+    header_size += sizeof(masking_key);
+    size_t frame_size = header_size + size;
+    debug("ws::websocket::write opcode %d, %u bytes in %u pieces\n", (int)opcode, size, pieces.size());
+
+    // Straight to the tcp buffer unless something has to go first
+    token_bucket &bucket = buckets[(size_t)level];
+    bucket.refill(get_absolute_time());
+    bool waiting = sending >= 0;
+    for(size_t i = 0; i <= (size_t)level; i++) {
+        waiting = waiting || !queues[i].empty();
+    }
+    if(!waiting && bucket.allows(frame_size) && frame_size <= tcp->sndbuf()) {
+        // tcp can refuse even with room in sndbuf, e.g. ERR_MEM when pbufs run out. Then
+        // the frame goes to the queue below and is only charged once it is sent.
+        send_result result = send_frame({header, header_size}, pieces, masking_key);
+        if(result == send_result::sent) {
+            bucket.take(frame_size);
+            return true;
+        }
+        if(result == send_result::broken) {
+            return false;
+        }
+    }
+
+    if(level != priority::control && queued_bytes + frame_size > WS_TX_QUEUE_LIMIT) {
+        error("ws::websocket::write: queue full, dropping %u byte frame\n", frame_size);
+        return false;
+    }
+    queued_frame frame;
+    frame.data.resize(frame_size);
+    memcpy(frame.data.data(), header, header_size);
+    size_t offset = 0;
+    for(std::span<const uint8_t> piece : pieces) {
+        mask_copy({frame.data.data() + header_size + offset, piece.size()}, piece, rotate_key(masking_key, offset));
+        offset += piece.size();
+    }
+    queued_bytes += frame_size;
+    queues[(size_t)level].push_back(std::move(frame));
+    flush_queue();
+    return true;
+}
+
+void ws::websocket::set_rate_limit(priority level, uint32_t bytes_per_second, uint32_t burst_bytes) {
+    if(level == priority::control || level == priority::count) {
+        error1("ws::websocket control frames can't be rate limited\n");
+        return;
+    }
+    token_bucket &bucket = buckets[(size_t)level];
+    bucket.rate = bytes_per_second;
+    bucket.burst = burst_bytes;
+    bucket.tokens = burst_bytes;
+    bucket.updated = get_absolute_time();
+}
+
+size_t ws::websocket::queued() const {
+    return queued_bytes;
+}
+
+ws::websocket::send_result ws::websocket::send_frame(std::span<const uint8_t> header, std::span<const std::span<const uint8_t>> pieces, uint32_t masking_key) {
+    size_t used = header.size();
+    std::copy(header.begin(), header.end(), tx_buffer);
+
+    // Mask each piece straight into the transmit buffer, sending it whenever it fills up
+    bool started = false;
+    auto send = [&]() {
+        if(tcp->write({tx_buffer, used})) {
+            started = true;
+            used = 0;
+            return true;
+        }
+        if(started) {
+            error1("ws::websocket::write failed in the middle of a frame, closing\n");
+            tcp->close(ERR_MEM);
+        }
+        return false;
+    };
+    size_t offset = 0;
+    for(std::span<const uint8_t> piece : pieces) {
+        while(piece.size() > 0) {
+            size_t count = std::min(piece.size(), sizeof(tx_buffer) - used);
+            mask_copy({tx_buffer + used, count}, piece.first(count), rotate_key(masking_key, offset));
+            used += count;
+            offset += count;
+            piece = piece.subspan(count);
+            if(used == sizeof(tx_buffer) && !send()) {
+                return started ? send_result::broken : send_result::refused;
+            }
+        }
+    }
+    if(used > 0 && !send()) {
+        return started ? send_result::broken : send_result::refused;
+    }
+    return send_result::sent;
+}
+
+// Skips the first merged[i] frames of each class, which are already in tx_buffer
+int ws::websocket::next_ready(const std::array<size_t, (size_t)priority::count> &merged, const std::array<token_bucket, (size_t)priority::count> &budget) const {
+    for(size_t i = 0; i < queues.size(); i++) {
+        if(queues[i].size() > merged[i] && budget[i].allows(queues[i][merged[i]].data.size())) {
+            return i;
+        }
+    }
+    return -1;
+}
 
-bool ws::websocket::write_frame(std::span<uint8_t> data, opcodes opcode) {
-    for(int i = -14; i < 0; i++) {
-        if(data[i] != ' ') {
-            error1("ws::websocket::write_frame expects 14 extra space bytes before the beginning of the given span!\n");
+void ws::websocket::flush_queue() {
+    if(queued_bytes == 0 || !tcp->connected()) {
+        return;
+    }
+    absolute_time_t now = get_absolute_time();
+    for(token_bucket &bucket : buckets) {
+        bucket.refill(now);
+    }
+
+    // Small frames are merged in tx_buffer and go out in one write. They stay queued, and
+    // their charges stay in budget, until that write succeeded; a failed one is retried
+    // from the next on_sent or poll.
+    size_t room = tcp->sndbuf();
+    size_t used = 0;
+    std::array<size_t, (size_t)priority::count> merged{};
+    std::array<token_bucket, (size_t)priority::count> budget = buckets;
+    auto send_merged = [&]() {
+        if(!tcp->write({tx_buffer, used})) {
+            error("ws::websocket failed to send %u bytes of queued frames, keeping them queued\n", used);
             return false;
         }
+        for(size_t i = 0; i < queues.size(); i++) {
+            for(; merged[i] > 0; merged[i]--) {
+                queued_bytes -= queues[i].front().data.size();
+                queues[i].pop_front();
+            }
+        }
+        buckets = budget;
+        room -= std::min(room, used);
+        used = 0;
+        return true;
+    };
+    while(true) {
+        int level = sending >= 0 ? sending : next_ready(merged, budget);
+        if(level < 0) {
+            break;
+        }
+        queued_frame &frame = queues[level][merged[level]];
+        size_t remaining = frame.data.size() - frame.sent;
+        if(frame.sent == 0 && used + remaining <= std::min(room, sizeof(tx_buffer))) {
+            std::copy_n(frame.data.data(), remaining, tx_buffer + used);
+            used += remaining;
+            budget[level].take(frame.data.size());
+            merged[level]++;
+        } else {
+            if(used > 0) {
+                if(!send_merged()) {
+                    return;
+                }
+                continue;
+            }
+            // Too big to merge, write as much as fits and finish it on the next on_sent
+            size_t count = std::min(remaining, room);
+            if(count == 0 || !tcp->write({frame.data.data() + frame.sent, count})) {
+                break;
+            }
+            room -= count;
+            if(frame.sent == 0) {
+                buckets[level].take(frame.data.size());
+                budget[level] = buckets[level];
+            }
+            frame.sent += count;
+            if(frame.sent < frame.data.size()) {
+                sending = level;
+                break;
+            }
+            sending = -1;
+            queued_bytes -= frame.data.size();
+            queues[level].pop_front();
+        }
+    }
+    if(used > 0) {
+        send_merged();
+    }
+}
+
+void ws::token_bucket::refill(absolute_time_t now) {
+    if(rate == 0) {
+        return;
     }
-    debug("websocket::write data=%p size=%d\n", data.data(), data.size());
-    uint32_t masking_key;
-    size_t olen;
-    mbedtls_hardware_poll(nullptr, (uint8_t*)&masking_key, sizeof(masking_key), &olen);
-    uint8_t frag_opcode = final_fragment | (uint8_t)opcode;
-    uint8_t is_masked_length = masked;
-    uint8_t length_field_size = (data.size() > 0xFFFF ? sizeof(uint64_t) : data.size() > 0x7D ? sizeof(uint16_t) : 0);
-    //uint8_t frame[2 + sizeof(masking_key) + length_field_size + data.size()];
-    uint8_t mask_offset = 2;
-    uint16_t length16;
-    uint64_t length64;
-    if(data.size() < 0x7E) {
-        is_masked_length |= (uint8_t)data.size();
-    } else if(data.size() <= 0xFFFF) {
-        is_masked_length |= has_length_16;
-        length16 = htons((uint16_t)data.size());
-        //memcpy(frame + 2, &size, sizeof(size));
-        mask_offset += sizeof(length16);
+    int64_t added = absolute_time_diff_us(updated, now) * rate / 1000000;
+    if(added <= 0) {
+        return;
+    }
+    tokens += added;
+    if(tokens >= burst) {
+        tokens = burst;
+        updated = now;
     } else {
-        is_masked_length |= has_length_64;
-        length64 = htonll((uint64_t)data.size());
-        // this would pretty much fill up our memory if we tried to send a packet > 64kb...
-        // probably shouldn't...
-        //memcpy(frame + 2, &size, sizeof(size));
-        mask_offset += sizeof(length64);
-    }
-    uint8_t data_offset = mask_offset + sizeof(masking_key);
-    data[-data_offset] = frag_opcode;
-    data[-data_offset + 1] = is_masked_length;
-    if((is_masked_length & 0x7F) == has_length_16) {
-        memcpy(data.data() -data_offset + 2, &length16, sizeof(length16));
-    } else if((is_masked_length & 0x7F) == has_length_64) {
-        memcpy(data.data() -data_offset + 2, &length64, sizeof(length64));
-    }
-    memcpy(data.data() - data_offset + mask_offset, &masking_key, sizeof(masking_key));
-    mask(data, masking_key);
-    bool res = tcp->write({data.data() - data_offset, data.size() + data_offset});
-    debug("tcp->write result: %d\n", res);
-    return res;
-}
\ No newline at end of file
+        // Keep the remainder so frequent refills don't round the rate down
+        updated = delayed_by_us(updated, added * 1000000 / rate);
+    }
+}
+
+bool ws::token_bucket::allows(size_t size) const {
+    return rate == 0 || tokens >= (int64_t)std::min<size_t>(size, burst);
+}
+
+void ws::token_bucket::take(size_t size) {
+    if(rate != 0) {
+        tokens -= size;
+    }
+}
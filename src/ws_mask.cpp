@@ -0,0 +1,79 @@
+#include "ws_mask.h"
+
+#include <algorithm>
+
+namespace {
+    typedef uint32_t __attribute__((may_alias)) word_t;
+}
+
+void ws::mask(std::span<uint8_t> data, uint32_t masking_key) {
+    mask_copy(data, data, masking_key);
+}
+
+void ws::mask_copy(std::span<uint8_t> out, std::span<const uint8_t> in, uint32_t masking_key) {
+    uint8_t *dst = out.data();
+    const uint8_t *src = in.data();
+    size_t size = in.size();
+    uint32_t key = masking_key;
+
+    size_t head = std::min<size_t>((4 - ((uintptr_t)dst & 3)) & 3, size);
+    for(size_t i = 0; i < head; i++) {
+        *dst++ = *src++ ^ (uint8_t)key;
+        key = rotate_key(key, 1);
+    }
+    size -= head;
+
+    word_t *dst_words = (word_t*)dst;
+    size_t words = size / 4;
+    size_t offset = (uintptr_t)src & 3;
+    if(offset != 0) {
+        // The Cortex-M0+ faults on unaligned word access, so when src can't be aligned together
+        // with dst each output word is put together from two aligned source words. Only words
+        // that lie entirely inside in are loaded: the bytes of the first one before the next
+        // word boundary are gathered one at a time, and when the last word would reach past
+        // the end of in it is left to the byte loop.
+        uint32_t shift = offset * 8;
+        if(words > 0 && (size & 3) < 4 - offset) {
+            words--;
+        }
+        if(words > 0) {
+            uint32_t low = 0;
+            for(size_t i = 0; i < 4 - offset; i++) {
+                low |= (uint32_t)src[i] << (shift + i * 8);
+            }
+            const word_t *src_words = (const word_t*)(src + 4 - offset);
+            for(size_t i = 0; i < words; i++) {
+                uint32_t high = *src_words++;
+                *dst_words++ = ((low >> shift) | (high << (32 - shift))) ^ key;
+                low = high;
+            }
+        }
+        dst = (uint8_t*)dst_words;
+        src += words * 4;
+        for(size_t i = words * 4; i < size; i++) {
+            *dst++ = *src++ ^ (uint8_t)key;
+            key = rotate_key(key, 1);
+        }
+        return;
+    }
+
+    const word_t *src_words = (const word_t*)src;
+    for(; words >= 4; words -= 4) {
+        dst_words[0] = src_words[0] ^ key;
+        dst_words[1] = src_words[1] ^ key;
+        dst_words[2] = src_words[2] ^ key;
+        dst_words[3] = src_words[3] ^ key;
+        dst_words += 4;
+        src_words += 4;
+    }
+    for(; words > 0; words--) {
+        *dst_words++ = *src_words++ ^ key;
+    }
+    dst = (uint8_t*)dst_words;
+    src = (const uint8_t*)src_words;
+
+    for(size_t i = 0; i < (size & 3); i++) {
+        *dst++ = *src++ ^ (uint8_t)key;
+        key = rotate_key(key, 1);
+    }
+}
@@ -0,0 +1,103 @@
+// Known-answer test for chacha_rng, and a host model of the masking key source it replaced
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#include "chacha_rng.h"
+
+// The keystream under test never reseeds, but chacha_rng.cpp links against the mbedTLS entropy hook
+extern "C" int mbedtls_hardware_poll(void *, unsigned char *output, size_t len, size_t *olen) {
+    memset(output, 0, len);
+    *olen = len;
+    return 0;
+}
+
+namespace {
+    int failures = 0;
+
+    void check(bool ok, const char *name) {
+        if(!ok) {
+            printf("FAIL %s\n", name);
+            failures++;
+        }
+    }
+
+    // RFC 8439 2.3.2: key 00..1f, nonce 00:00:00:09:00:00:00:4a:00:00:00:00, block count 1
+    void test_rfc8439_block() {
+        uint8_t key[32];
+        for(size_t i = 0; i < sizeof(key); i++) {
+            key[i] = i;
+        }
+        const uint8_t nonce[12] = {0x00, 0x00, 0x00, 0x09, 0x00, 0x00, 0x00, 0x4a, 0x00, 0x00, 0x00, 0x00};
+        const uint32_t expected[16] = {
+            0xe4e7f110, 0x15593bd1, 0x1fdd0f50, 0xc47120a3,
+            0xc7f4d1c7, 0x0368c033, 0x9aaa2204, 0x4e6cd4c3,
+            0x466482d2, 0x09aa9f07, 0x05d7c214, 0xa2028bd9,
+            0xd19c12b5, 0xb94e16de, 0xe883d0cb, 0x4e3c50a2
+        };
+        chacha_rng &rng = chacha_rng::instance();
+        rng.seed(key, 1, nonce);
+        bool match = true;
+        for(uint32_t word : expected) {
+            match = match && rng.next() == word;
+        }
+        check(match, "RFC 8439 2.3.2 block");
+
+        // The serialized block of 2.3.2 starts 10 f1 e7 e4, fill() hands out the same bytes
+        const uint8_t serialized[] = {0x10, 0xf1, 0xe7, 0xe4, 0xd1, 0x3b, 0x59};
+        uint8_t bytes[sizeof(serialized)];
+        rng.seed(key, 1, nonce);
+        rng.fill(bytes);
+        check(std::equal(bytes, bytes + sizeof(bytes), serialized), "RFC 8439 2.3.2 serialized block");
+    }
+
+    constexpr int keys = 100000;
+
+    // The old write path: every frame gathered its key one ring oscillator bit at a time
+    // through mbedtls_hardware_poll. Each bit is a register read, modeled here as a volatile
+    // load, so the host figure is a lower bound on what the device paid.
+    volatile uint32_t randombit = 1;
+
+    uint32_t __attribute__((noinline)) old_masking_key() {
+        uint32_t key = 0;
+        for(int bit = 0; bit < 32; bit++) {
+            key = (key << 1) | (randombit & 1);
+        }
+        return key;
+    }
+
+    template <typename F>
+    double ns_per_key(F &&function) {
+        uint32_t sink = 0;
+        auto start = std::chrono::steady_clock::now();
+        for(int i = 0; i < keys; i++) {
+            sink ^= function();
+        }
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / keys;
+        randombit = randombit ^ (sink & 0);
+        return ns;
+    }
+
+    void benchmark_masking_key() {
+        chacha_rng &rng = chacha_rng::instance();
+        double old_path = ns_per_key(old_masking_key);
+        double chacha = ns_per_key([&]() { return rng.next(); });
+        // The frame that has to run a block pays for all 16 keys of it
+        double block = 0;
+        for(int i = 0; i < 16; i++) {
+            auto start = std::chrono::steady_clock::now();
+            rng.next();
+            block = std::max(block, std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+        }
+        printf("masking key: old path model %6.1f ns, chacha %6.1f ns (worst frame %6.1f ns) per key\n", old_path, chacha, block);
+    }
+}
+
+int main() {
+    test_rfc8439_block();
+    benchmark_masking_key();
+    printf("chacha_rng_test: %d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+// Just enough of the Pico SDK time API for the portable sources built on the host
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+typedef uint64_t absolute_time_t;
+
+inline absolute_time_t get_absolute_time() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline uint32_t to_ms_since_boot(absolute_time_t t) {
+    return t / 1000;
+}
+
+inline int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to) {
+    return (int64_t)(to - from);
+}
@@ -0,0 +1,107 @@
+// Wire bytes and decode time of a device data response with and without Content-Encoding.
+// The fixture has the shape of /v1/devices/<mac>?limit=96; host timings are only useful
+// relative to each other, the device logs its own decode time per response.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+#include <zlib.h>
+
+#include "inflate.h"
+
+namespace {
+    constexpr int repetitions = 50;
+
+    std::vector<uint8_t> compress(const std::vector<uint8_t> &input, int level, int window_bits) {
+        z_stream stream{};
+        deflateInit2(&stream, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY);
+        std::vector<uint8_t> output(deflateBound(&stream, input.size()));
+        stream.next_in = (Bytef*)input.data();
+        stream.avail_in = input.size();
+        stream.next_out = output.data();
+        stream.avail_out = output.size();
+        deflate(&stream, Z_FINISH);
+        output.resize(stream.total_out);
+        deflateEnd(&stream);
+        return output;
+    }
+
+    template <typename F>
+    double best_us(F &&function) {
+        double best = 1e30;
+        for(int i = 0; i < repetitions; i++) {
+            auto start = std::chrono::steady_clock::now();
+            function();
+            best = std::min(best, std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+        }
+        return best;
+    }
+
+    // Decodes the way http_response does, in pieces the size of a TCP segment
+    bool inflate_in_segments(const std::vector<uint8_t> &compressed, inflater::format format, const std::vector<uint8_t> &expected) {
+        constexpr size_t segment = 1460;
+        inflater decoder(format);
+        size_t produced = 0;
+        bool match = true;
+        decoder.on_output([&](std::span<const uint8_t> data) {
+            match = match && produced + data.size() <= expected.size() && std::equal(data.begin(), data.end(), expected.begin() + produced);
+            produced += data.size();
+        });
+        inflater::status status = inflater::status::ok;
+        for(size_t offset = 0; offset < compressed.size() && status == inflater::status::ok; offset += segment) {
+            status = decoder.write({compressed.data() + offset, std::min(segment, compressed.size() - offset)});
+        }
+        return status == inflater::status::done && match && produced == expected.size();
+    }
+
+    bool zlib_reference(const std::vector<uint8_t> &compressed, int window_bits, std::vector<uint8_t> &output) {
+        z_stream stream{};
+        inflateInit2(&stream, window_bits);
+        stream.next_in = (Bytef*)compressed.data();
+        stream.avail_in = compressed.size();
+        stream.next_out = output.data();
+        stream.avail_out = output.size();
+        int result = inflate(&stream, Z_FINISH);
+        inflateEnd(&stream);
+        return result == Z_STREAM_END;
+    }
+}
+
+int main(int argc, char **argv) {
+    if(argc < 2) {
+        printf("usage: %s <response body>\n", argv[0]);
+        return 2;
+    }
+    std::ifstream file(argv[1], std::ios::binary);
+    std::vector<uint8_t> body{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+    if(body.empty()) {
+        printf("could not read %s\n", argv[1]);
+        return 2;
+    }
+
+    printf("identity: %7zu bytes on the wire\n", body.size());
+    bool ok = true;
+    struct encoding {
+        const char *name;
+        inflater::format format;
+        int window_bits;
+    };
+    // Level 1 is what nginx uses by default, 6 is zlib's default
+    for(int level : {1, 6}) {
+        for(const encoding &e : {encoding{"gzip", inflater::format::gzip, 31}, encoding{"deflate", inflater::format::zlib, 15}}) {
+            std::vector<uint8_t> compressed = compress(body, level, e.window_bits);
+            bool decoded = inflate_in_segments(compressed, e.format, body);
+            double ours = best_us([&]() { inflate_in_segments(compressed, e.format, body); });
+            std::vector<uint8_t> scratch(body.size());
+            double reference = best_us([&]() { zlib_reference(compressed, e.window_bits, scratch); });
+            printf("%-7s level %d: %7zu bytes on the wire (%4.1f%%), inflater %8.1f us, zlib %8.1f us%s\n",
+                e.name, level, compressed.size(), 100.0 * compressed.size() / body.size(), ours, reference, decoded ? "" : "  DECODE MISMATCH");
+            ok = ok && decoded;
+        }
+    }
+    return ok ? 0 : 1;
+}
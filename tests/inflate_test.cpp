@@ -0,0 +1,200 @@
+// Host tests for inflater, with zlib producing the compressed input
+
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+#include "inflate.h"
+
+namespace {
+    int failures = 0;
+
+    void check(bool ok, const char *name) {
+        if(!ok) {
+            printf("FAIL %s\n", name);
+            failures++;
+        }
+    }
+
+    // window_bits as deflateInit2 takes them: negative for raw, +16 for gzip
+    std::vector<uint8_t> compress(const std::vector<uint8_t> &input, int level, int strategy, int window_bits) {
+        z_stream stream{};
+        deflateInit2(&stream, level, Z_DEFLATED, window_bits, 8, strategy);
+        std::vector<uint8_t> output(deflateBound(&stream, input.size()));
+        stream.next_in = (Bytef*)input.data();
+        stream.avail_in = input.size();
+        stream.next_out = output.data();
+        stream.avail_out = output.size();
+        deflate(&stream, Z_FINISH);
+        output.resize(stream.total_out);
+        deflateEnd(&stream);
+        return output;
+    }
+
+    struct result {
+        std::vector<uint8_t> output;
+        inflater::status status = inflater::status::ok;
+    };
+
+    // Feeds the input in pieces of at most piece bytes, stopping at the first error
+    result decompress(const std::vector<uint8_t> &input, inflater::format format, uint8_t window_bits, size_t piece) {
+        inflater decoder(format, window_bits);
+        result r;
+        decoder.on_output([&](std::span<const uint8_t> data) {
+            r.output.insert(r.output.end(), data.begin(), data.end());
+        });
+        for(size_t offset = 0; offset < input.size() && r.status == inflater::status::ok; offset += piece) {
+            size_t count = std::min(piece, input.size() - offset);
+            r.status = decoder.write({input.data() + offset, count});
+        }
+        return r;
+    }
+
+    // JSON-ish text with some noise, like the REST responses
+    std::vector<uint8_t> sample_text(size_t size, std::mt19937 &rng) {
+        std::string text;
+        while(text.size() < size) {
+            text += "{\"tempf\":" + std::to_string(rng() % 1000 / 10.0) + ",\"humidity\":" + std::to_string(rng() % 100) + "},";
+            if(rng() % 4 == 0) {
+                text += (char)(rng() % 256);
+            }
+        }
+        text.resize(size);
+        return {text.begin(), text.end()};
+    }
+
+    std::vector<uint8_t> random_bytes(size_t size, std::mt19937 &rng) {
+        std::vector<uint8_t> bytes(size);
+        for(uint8_t &byte : bytes) {
+            byte = rng();
+        }
+        return bytes;
+    }
+
+    void test_block_types(std::mt19937 &rng) {
+        struct block_type {
+            const char *name;
+            int level, strategy;
+        };
+        const block_type types[] = {
+            {"stored", 0, Z_DEFAULT_STRATEGY},
+            {"fixed", 6, Z_FIXED},
+            {"dynamic", 6, Z_DEFAULT_STRATEGY},
+            {"dynamic huffman only", 6, Z_HUFFMAN_ONLY}
+        };
+        struct stream_format {
+            inflater::format format;
+            int window_bits;
+        };
+        const stream_format formats[] = {
+            {inflater::format::raw, -15},
+            {inflater::format::zlib, 15},
+            {inflater::format::gzip, 31}
+        };
+        for(const block_type &type : types) {
+            for(const stream_format &format : formats) {
+                // Stored blocks hold at most 64 KiB, so the large input spans several
+                for(size_t size : {0u, 1u, 1000u, 150000u}) {
+                    std::vector<uint8_t> input = sample_text(size, rng);
+                    std::vector<uint8_t> compressed = compress(input, type.level, type.strategy, format.window_bits);
+                    for(size_t piece : {(size_t)1, (size_t)7, (size_t)4096, compressed.size() + 1}) {
+                        result r = decompress(compressed, format.format, INFLATE_MAX_WINDOW_BITS, piece);
+                        char name[96];
+                        snprintf(name, sizeof(name), "%s, format %d, %zu bytes, %zu byte pieces", type.name, (int)format.format, size, piece);
+                        check(r.status == inflater::status::done && r.output == input, name);
+                    }
+                }
+            }
+        }
+    }
+
+    // A random block repeated almost a full window later, so matches reach back ~32 KiB
+    // and wrap around the window buffer
+    void test_window_distances(std::mt19937 &rng) {
+        std::vector<uint8_t> repeated = random_bytes(1000, rng);
+        std::vector<uint8_t> input;
+        for(int i = 0; i < 8; i++) {
+            input.insert(input.end(), repeated.begin(), repeated.end());
+            std::vector<uint8_t> filler = random_bytes(31000, rng);
+            input.insert(input.end(), filler.begin(), filler.end());
+        }
+        std::vector<uint8_t> compressed = compress(input, 9, Z_DEFAULT_STRATEGY, -15);
+        // Incompressible filler would be ~8x32000 bytes, the repeats must have matched
+        check(compressed.size() < input.size() - 6000, "far matches were produced");
+        for(size_t piece : {(size_t)3, (size_t)1500, compressed.size()}) {
+            result r = decompress(compressed, inflater::format::raw, 15, piece);
+            check(r.status == inflater::status::done && r.output == input, "distances across the window");
+        }
+
+        // A decoder with a smaller window has to refuse them rather than read stale memory
+        result small = decompress(compressed, inflater::format::raw, 10, compressed.size());
+        check(small.status == inflater::status::error, "distance beyond a small window");
+
+        // Data compressed for a 1 KiB window decodes with one
+        std::vector<uint8_t> text = sample_text(20000, rng);
+        result fitted = decompress(compress(text, 6, Z_DEFAULT_STRATEGY, -10), inflater::format::raw, 10, 100);
+        check(fitted.status == inflater::status::done && fitted.output == text, "1 KiB window");
+    }
+
+    void test_truncated(std::mt19937 &rng) {
+        std::vector<uint8_t> input = sample_text(20000, rng);
+        for(int window_bits : {15, 31}) {
+            std::vector<uint8_t> compressed = compress(input, 6, Z_DEFAULT_STRATEGY, window_bits);
+            inflater::format format = window_bits == 31 ? inflater::format::gzip : inflater::format::zlib;
+            for(size_t cut : {(size_t)1, (size_t)5, compressed.size() / 2, compressed.size() - 1}) {
+                std::vector<uint8_t> truncated(compressed.begin(), compressed.begin() + cut);
+                result r = decompress(truncated, format, INFLATE_MAX_WINDOW_BITS, 64);
+                // Truncated input is indistinguishable from input still on its way
+                check(r.status == inflater::status::ok, "truncated stream waits for more");
+                check(r.output.size() <= input.size() && std::equal(r.output.begin(), r.output.end(), input.begin()), "truncated stream output is a prefix");
+            }
+        }
+    }
+
+    void test_corrupt(std::mt19937 &rng) {
+        auto fails = [](std::vector<uint8_t> input, inflater::format format) {
+            return decompress(input, format, INFLATE_MAX_WINDOW_BITS, input.size()).status == inflater::status::error;
+        };
+        // Final block with the reserved type 11
+        check(fails({0x07, 0x00}, inflater::format::raw), "reserved block type");
+        // Stored block whose NLEN isn't the complement of LEN
+        check(fails({0x01, 0x05, 0x00, 0x00, 0x00, 'a'}, inflater::format::raw), "stored length mismatch");
+        check(fails({0x1F, 0x8C, 0x08, 0, 0, 0, 0, 0, 0, 0}, inflater::format::gzip), "bad gzip magic");
+        check(fails({0x78, 0xBB, 0x00, 0x00, 0x00, 0x00}, inflater::format::zlib), "zlib preset dictionary");
+
+        std::vector<uint8_t> input = sample_text(5000, rng);
+        std::vector<uint8_t> zlib = compress(input, 6, Z_DEFAULT_STRATEGY, 15);
+        zlib.back() ^= 0x01;
+        check(fails(zlib, inflater::format::zlib), "adler32 mismatch");
+        std::vector<uint8_t> gzip = compress(input, 6, Z_DEFAULT_STRATEGY, 31);
+        gzip[gzip.size() - 8] ^= 0x01;
+        check(fails(gzip, inflater::format::gzip), "crc32 mismatch");
+        gzip = compress(input, 6, Z_DEFAULT_STRATEGY, 31);
+        gzip.back() ^= 0x01;
+        check(fails(gzip, inflater::format::gzip), "gzip length mismatch");
+
+        // Random damage must end in an error or a wrong result, never in a crash or a hang
+        std::vector<uint8_t> clean = compress(input, 6, Z_DEFAULT_STRATEGY, 31);
+        for(int i = 0; i < 2000; i++) {
+            std::vector<uint8_t> damaged = clean;
+            for(int flips = 1 + rng() % 4; flips > 0; flips--) {
+                damaged[10 + rng() % (damaged.size() - 10)] ^= 1 << (rng() % 8);
+            }
+            result r = decompress(damaged, inflater::format::gzip, INFLATE_MAX_WINDOW_BITS, 1 + rng() % 512);
+            check(r.status != inflater::status::done || r.output == input, "damaged stream detected by the trailer");
+        }
+    }
+}
+
+int main() {
+    std::mt19937 rng(1);
+    test_block_types(rng);
+    test_window_distances(rng);
+    test_truncated(rng);
+    test_corrupt(rng);
+    printf("inflate_test: %d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
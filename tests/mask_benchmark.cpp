@@ -0,0 +1,65 @@
+// Host timings of the masking kernel for the payload sizes the device benchmark uses. Like
+// http_decode_benchmark the numbers are only useful relative to each other: benchmark_mask
+// in src/benchmarks.cpp gives the Cortex-M0+ cycle counts.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#include "ws_mask.h"
+
+namespace {
+    constexpr int repetitions = 2000;
+    constexpr uint32_t key = 0x9E3779B9;
+
+    template <typename F>
+    double best_ns(F &&function) {
+        double best = 1e30;
+        for(int i = 0; i < repetitions; i++) {
+            auto start = std::chrono::steady_clock::now();
+            function();
+            best = std::min(best, std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+        }
+        return best;
+    }
+
+    // What ws::websocket::mask did before the word loop
+    void __attribute__((noinline)) mask_bytewise(uint8_t *data, size_t size, uint32_t masking_key) {
+        const uint8_t *key_bytes = (const uint8_t*)&masking_key;
+        for(size_t i = 0; i < size; i++) {
+            data[i] ^= key_bytes[i % 4];
+        }
+    }
+}
+
+int main() {
+    static uint8_t source[16384 + 4] __attribute__((aligned(4)));
+    static uint8_t target[16384 + 4] __attribute__((aligned(4)));
+    static uint8_t expected[16384 + 4] __attribute__((aligned(4)));
+    for(size_t i = 0; i < sizeof(source); i++) {
+        source[i] = i * 31;
+    }
+
+    bool ok = true;
+    for(size_t size : {125u, 1024u, 16384u}) {
+        std::copy_n(source, size, expected);
+        mask_bytewise(expected, size, key);
+        ws::mask_copy({target + 1, size}, {source, size}, key);
+        bool correct = std::equal(expected, expected + size, target + 1);
+        ok = ok && correct;
+
+        double bytewise = best_ns([&]() { mask_bytewise(target, size, key); });
+        double word = best_ns([&]() { ws::mask({target, size}, key); });
+        double unaligned = best_ns([&]() { ws::mask({target + 1, size}, key); });
+        double copy = best_ns([&]() { ws::mask_copy({target, size}, {source, size}, key); });
+        double copy_misaligned = best_ns([&]() { ws::mask_copy({target + 1, size}, {source, size}, key); });
+        double copy_two_pass = best_ns([&]() {
+            memmove(target + 1, source, size);
+            ws::mask({target + 1, size}, key);
+        });
+        printf("mask %5zu B: bytewise %8.0f, word %8.0f, unaligned %8.0f, copy %8.0f, copy misaligned %8.0f (memmove + mask %8.0f) ns%s\n",
+            size, bytewise, word, unaligned, copy, copy_misaligned, copy_two_pass, correct ? "" : "  MISMATCH");
+    }
+    return ok ? 0 : 1;
+}
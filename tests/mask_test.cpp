@@ -0,0 +1,91 @@
+// Host tests for ws::mask and ws::mask_copy against the plain bytewise loop. Built with
+// AddressSanitizer, so a word load reaching outside the input is reported.
+
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "ws_mask.h"
+
+namespace {
+    int failures = 0;
+
+    void check(bool ok, const char *name, size_t size, size_t src_offset, size_t dst_offset) {
+        if(!ok) {
+            printf("FAIL %s, %zu bytes, src offset %zu, dst offset %zu\n", name, size, src_offset, dst_offset);
+            failures++;
+        }
+    }
+
+    void mask_bytewise(uint8_t *data, size_t size, uint32_t key) {
+        for(size_t i = 0; i < size; i++) {
+            data[i] ^= key >> (i % 4 * 8);
+        }
+    }
+
+    // Each buffer is its own allocation ending right after the data, and new[] returns
+    // memory aligned to at least 8, so offset sets the alignment of the data
+    struct buffer {
+        std::unique_ptr<uint8_t[]> storage;
+        uint8_t *data;
+
+        buffer(size_t offset, size_t size): storage(new uint8_t[offset + size]), data(storage.get() + offset) {}
+    };
+
+    void test_size(size_t size, std::mt19937 &rng) {
+        uint32_t key = rng();
+        std::vector<uint8_t> input(size), expected(size);
+        for(uint8_t &byte : input) {
+            byte = rng();
+        }
+        expected = input;
+        mask_bytewise(expected.data(), size, key);
+
+        for(size_t src_offset = 0; src_offset < 4; src_offset++) {
+            buffer in(src_offset, size);
+            std::copy(input.begin(), input.end(), in.data);
+            ws::mask({in.data, size}, key);
+            check(std::equal(expected.begin(), expected.end(), in.data), "mask", size, src_offset, src_offset);
+
+            std::copy(input.begin(), input.end(), in.data);
+            for(size_t dst_offset = 0; dst_offset < 4; dst_offset++) {
+                buffer out(dst_offset, size);
+                ws::mask_copy({out.data, size}, {in.data, size}, key);
+                check(std::equal(expected.begin(), expected.end(), out.data), "mask_copy", size, src_offset, dst_offset);
+                check(std::equal(input.begin(), input.end(), in.data), "mask_copy leaves its input alone", size, src_offset, dst_offset);
+            }
+        }
+    }
+
+    // Masking a payload in pieces has to match masking it whole, the way frames are written
+    void test_pieces(std::mt19937 &rng) {
+        std::vector<uint8_t> input(1000), expected;
+        for(uint8_t &byte : input) {
+            byte = rng();
+        }
+        uint32_t key = rng();
+        expected = input;
+        mask_bytewise(expected.data(), expected.size(), key);
+        std::vector<uint8_t> output(input.size());
+        for(size_t offset = 0; offset < input.size();) {
+            size_t count = std::min<size_t>(1 + rng() % 37, input.size() - offset);
+            ws::mask_copy({output.data() + offset, count}, {input.data() + offset, count}, ws::rotate_key(key, offset));
+            offset += count;
+        }
+        check(output == expected, "mask_copy in pieces", input.size(), 0, 0);
+    }
+}
+
+int main() {
+    std::mt19937 rng(1);
+    for(size_t size = 0; size <= 9; size++) {
+        test_size(size, rng);
+    }
+    for(size_t size : {125u, 1024u, 16384u}) {
+        test_size(size, rng);
+    }
+    test_pieces(rng);
+    printf("mask_test: %d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}